@@ -0,0 +1,525 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../source/database.h"
+
+/*
+ * Benchmark of the engine under a set of standard workloads. Every workload
+ * runs on a fresh database and times each of its operations; the results are
+ * printed as a table or as JSON so runs can be compared before and after a
+ * change.
+ *
+ *   bench_embeddeddb [-j] [-f file] [-n records] [-o ops] [-t threads]
+ *           [-b batch] [-p page_size] [-s sync] [workload...]
+ */
+
+#define KEY_SIZE 16
+#define VALUE_SIZE 100
+
+/* latencies are bucketed with 16 linear steps per power of two, so within 6% */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB)
+
+typedef struct histogram_t
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} histogram_t;
+
+typedef struct bench_t
+{
+	const char *filename;
+	size_t records; /* records loaded before the read and mixed workloads */
+	size_t ops;     /* operations per workload (per thread for readers) */
+	size_t threads;
+	size_t batch;   /* writes per transaction */
+	database_options_t options;
+	int json;
+} bench_t;
+
+typedef struct result_t
+{
+	const char *name;
+	size_t ops;
+	double seconds;
+	histogram_t histogram;
+	off_t file_size;
+} result_t;
+
+typedef struct workload_t
+{
+	const char *name;
+	int (*run)(bench_t *bench, database_t *database, result_t *result);
+} workload_t;
+
+static size_t histogram_bucket(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB)
+		return value;
+	size_t exponent = 63 - __builtin_clzll(value);
+	size_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1);
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + sub;
+}
+
+/* the smallest value that falls in @bucket */
+static uint64_t histogram_value(size_t bucket)
+{
+	if (bucket < HISTOGRAM_SUB)
+		return bucket;
+	size_t exponent = bucket / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = bucket % HISTOGRAM_SUB;
+	return (HISTOGRAM_SUB + sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+static void histogram_record(histogram_t *histogram, uint64_t value)
+{
+	histogram->counts[histogram_bucket(value)] += 1;
+	histogram->total += 1;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+static void histogram_merge(histogram_t *into, const histogram_t *from)
+{
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		into->counts[i] += from->counts[i];
+	into->total += from->total;
+	if (from->max > into->max)
+		into->max = from->max;
+}
+
+static uint64_t histogram_percentile(const histogram_t *histogram, double percentile)
+{
+	uint64_t rank = (uint64_t) (histogram->total * percentile / 100.0);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->counts[i];
+		if (seen > rank)
+			return histogram_value(i);
+	}
+	return histogram->max;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded per workload and thread so runs are reproducible */
+static uint64_t random_next(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1d;
+}
+
+static void make_key(char *key, size_t i)
+{
+	snprintf(key, KEY_SIZE + 1, "%016zu", i);
+}
+
+static void make_value(char *value, size_t i)
+{
+	memset(value, 'a' + i % 26, VALUE_SIZE);
+}
+
+/* put records 0 to @records - 1 in one transaction */
+static int load(database_t *database, size_t records)
+{
+	transaction_t *transaction;
+	if ((transaction = start_transaction(database, TRANSACTION_MODE_RW)) == NULL)
+		return -1;
+	char key[KEY_SIZE + 1], value[VALUE_SIZE];
+	for (size_t i = 0; i < records; i++)
+	{
+		make_key(key, i);
+		make_value(value, i);
+		if (db_put(transaction, key, KEY_SIZE, value, VALUE_SIZE) == -1)
+		{
+			cancel_transaction(database, transaction);
+			return -1;
+		}
+	}
+	return commit_transaction(database, transaction);
+}
+
+/* one operation per read transaction; @random picks keys at random */
+static int run_reads(bench_t *bench, database_t *database, histogram_t *histogram,
+		uint64_t seed, int random)
+{
+	char key[KEY_SIZE + 1];
+	for (size_t i = 0; i < bench->ops; i++)
+	{
+		size_t record = random ? random_next(&seed) % bench->records : i % bench->records;
+		make_key(key, record);
+
+		uint64_t start = now_ns();
+		transaction_t *transaction;
+		if ((transaction = start_transaction(database, TRANSACTION_MODE_READ)) == NULL)
+			return -1;
+		const void *value;
+		size_t value_size;
+		int r = db_get(transaction, key, KEY_SIZE, &value, &value_size);
+		if (commit_transaction(database, transaction) == -1)
+			return -1;
+		histogram_record(histogram, now_ns() - start);
+		if (r == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes, bench->batch per read-write transaction, mixed with reads: each
+ * operation is a write with probability @write_percent. Only whole
+ * transactions are timed when batching, counted once per operation.
+ */
+static int run_mixed(bench_t *bench, database_t *database, histogram_t *histogram,
+		uint64_t seed, int random, unsigned write_percent, size_t records)
+{
+	char key[KEY_SIZE + 1], value[VALUE_SIZE];
+	for (size_t i = 0; i < bench->ops; )
+	{
+		int write = random_next(&seed) % 100 < write_percent;
+		size_t n = write ? bench->batch : 1;
+		if (n > bench->ops - i)
+			n = bench->ops - i;
+
+		uint64_t start = now_ns();
+		transaction_t *transaction;
+		if ((transaction = start_transaction(database, write
+				? TRANSACTION_MODE_RW : TRANSACTION_MODE_READ)) == NULL)
+			return -1;
+		for (size_t j = 0; j < n; j++)
+		{
+			size_t record = random ? random_next(&seed) % records : (i + j) % records;
+			make_key(key, record);
+			int r;
+			if (write)
+			{
+				make_value(value, i + j);
+				r = db_put(transaction, key, KEY_SIZE, value, VALUE_SIZE);
+			}
+			else
+			{
+				const void *data;
+				size_t data_size;
+				r = db_get(transaction, key, KEY_SIZE, &data, &data_size);
+			}
+			if (r == -1 && errno != ENOENT)
+			{
+				cancel_transaction(database, transaction);
+				return -1;
+			}
+		}
+		if (commit_transaction(database, transaction) == -1)
+			return -1;
+		uint64_t elapsed = (now_ns() - start) / n;
+		for (size_t j = 0; j < n; j++)
+			histogram_record(histogram, elapsed);
+		i += n;
+	}
+	return 0;
+}
+
+static int fill_sequential(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_mixed(bench, database, &result->histogram, 1, 0, 100, bench->ops);
+}
+
+static int fill_random(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_mixed(bench, database, &result->histogram, 2, 1, 100, bench->ops);
+}
+
+static int read_sequential(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_reads(bench, database, &result->histogram, 3, 0);
+}
+
+static int read_random(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_reads(bench, database, &result->histogram, 4, 1);
+}
+
+static int mixed_90_10(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_mixed(bench, database, &result->histogram, 5, 1, 10, bench->records);
+}
+
+static int mixed_50_50(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_mixed(bench, database, &result->histogram, 6, 1, 50, bench->records);
+}
+
+typedef struct reader_thread_t
+{
+	bench_t *bench;
+	database_t *database;
+	histogram_t histogram;
+	uint64_t seed;
+	int r;
+} reader_thread_t;
+
+static void *reader_thread(void *argument)
+{
+	reader_thread_t *thread = argument;
+	thread->r = run_reads(thread->bench, thread->database, &thread->histogram,
+			thread->seed, 1);
+	return NULL;
+}
+
+/* bench->threads threads reading at random at once */
+static int readers_threads(bench_t *bench, database_t *database, result_t *result)
+{
+	reader_thread_t *threads;
+	pthread_t *ids;
+	if ((threads = calloc(bench->threads, sizeof(*threads))) == NULL)
+		return -1;
+	if ((ids = calloc(bench->threads, sizeof(*ids))) == NULL)
+	{
+		free(threads);
+		return -1;
+	}
+
+	size_t started = 0;
+	for (; started < bench->threads; started++)
+	{
+		threads[started].bench = bench;
+		threads[started].database = database;
+		threads[started].seed = 7 + started;
+		if (pthread_create(&ids[started], NULL, reader_thread, &threads[started]) != 0)
+			break;
+	}
+	int r = started == bench->threads ? 0 : -1;
+	for (size_t i = 0; i < started; i++)
+	{
+		pthread_join(ids[i], NULL);
+		histogram_merge(&result->histogram, &threads[i].histogram);
+		if (threads[i].r == -1)
+			r = -1;
+	}
+	free(threads);
+	free(ids);
+	return r;
+}
+
+/* random inserts on top of the loaded records, so the file keeps growing */
+static int grow_random(bench_t *bench, database_t *database, result_t *result)
+{
+	return run_mixed(bench, database, &result->histogram, 8, 1, 100,
+			bench->records * 10 + bench->ops);
+}
+
+static const workload_t workloads[] = {
+	{ "fill_sequential", fill_sequential },
+	{ "fill_random", fill_random },
+	{ "read_sequential", read_sequential },
+	{ "read_random", read_random },
+	{ "mixed_90_10", mixed_90_10 },
+	{ "mixed_50_50", mixed_50_50 },
+	{ "readers_threads", readers_threads },
+	{ "grow_random", grow_random },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/* indexed by SYNC_MODE */
+static const char *sync_modes[] = { "none", "async", "commit", "group" };
+#define NUM_SYNC_MODES (sizeof(sync_modes) / sizeof(sync_modes[0]))
+
+/* the fill workloads start from an empty database, the others from a loaded one */
+static int workload_loads(const workload_t *workload)
+{
+	return strncmp(workload->name, "fill_", 5) != 0;
+}
+
+static void remove_database(const char *filename)
+{
+	char lock[4096];
+	snprintf(lock, sizeof(lock), "%s-lock", filename);
+	unlink(filename);
+	unlink(lock);
+}
+
+static int run_workload(bench_t *bench, const workload_t *workload, result_t *result)
+{
+	memset(result, 0, sizeof(*result));
+	result->name = workload->name;
+
+	remove_database(bench->filename);
+	database_t *database;
+	if ((database = database_new_with((char *) bench->filename, &bench->options)) == NULL)
+		return -1;
+	if (workload_loads(workload) && load(database, bench->records) == -1)
+	{
+		database_close(database);
+		return -1;
+	}
+
+	uint64_t start = now_ns();
+	int r = workload->run(bench, database, result);
+	result->seconds = (now_ns() - start) / 1e9;
+	result->ops = result->histogram.total;
+
+	struct stat st;
+	if (stat(bench->filename, &st) == 0)
+		result->file_size = st.st_size;
+	database_close(database);
+	remove_database(bench->filename);
+	return r;
+}
+
+static void print_text_header(void)
+{
+	printf("%-16s %10s %12s %10s %10s %10s %10s %12s\n", "workload", "ops",
+			"ops/sec", "p50 ns", "p99 ns", "p999 ns", "max ns", "file bytes");
+}
+
+static void print_text(const result_t *result)
+{
+	const histogram_t *histogram = &result->histogram;
+	printf("%-16s %10zu %12.0f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+			" %12lld\n", result->name, result->ops, result->ops / result->seconds,
+			histogram_percentile(histogram, 50), histogram_percentile(histogram, 99),
+			histogram_percentile(histogram, 99.9), histogram->max,
+			(long long) result->file_size);
+}
+
+static void print_json(const bench_t *bench, const result_t *results, size_t n)
+{
+	printf("{\n  \"records\": %zu,\n  \"ops\": %zu,\n  \"threads\": %zu,\n"
+			"  \"batch\": %zu,\n  \"page_size\": %zu,\n  \"sync\": \"%s\",\n"
+			"  \"workloads\": [\n", bench->records, bench->ops, bench->threads,
+			bench->batch, bench->options.page_size, sync_modes[bench->options.sync]);
+	for (size_t i = 0; i < n; i++)
+	{
+		const histogram_t *histogram = &results[i].histogram;
+		printf("    {\"name\": \"%s\", \"ops\": %zu, \"seconds\": %.6f, "
+				"\"ops_per_sec\": %.0f, \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+				", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64
+				", \"file_size\": %lld}%s\n", results[i].name, results[i].ops,
+				results[i].seconds, results[i].ops / results[i].seconds,
+				histogram_percentile(histogram, 50), histogram_percentile(histogram, 99),
+				histogram_percentile(histogram, 99.9), histogram->max,
+				(long long) results[i].file_size, i + 1 < n ? "," : "");
+	}
+	printf("  ]\n}\n");
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [-j] [-f file] [-n records] [-o ops] [-t threads]\n"
+			"       [-b batch] [-p page_size] [-s none|async|commit|group] [workload...]\n"
+			"workloads:", program);
+	for (size_t i = 0; i < NUM_WORKLOADS; i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	bench_t bench = {
+		.filename = "/tmp/bench_embeddeddb",
+		.records = 100000,
+		.ops = 100000,
+		.threads = 4,
+		.batch = 1,
+		.options = DATABASE_OPTIONS_DEFAULT,
+		.json = 0
+	};
+
+	int option;
+	while ((option = getopt(argc, argv, "jf:n:o:t:b:p:s:")) != -1)
+	{
+		switch (option)
+		{
+			case 'j':
+				bench.json = 1;
+				break;
+			case 'f':
+				bench.filename = optarg;
+				break;
+			case 'n':
+				bench.records = strtoull(optarg, NULL, 10);
+				break;
+			case 'o':
+				bench.ops = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				bench.threads = strtoull(optarg, NULL, 10);
+				break;
+			case 'b':
+				bench.batch = strtoull(optarg, NULL, 10);
+				break;
+			case 'p':
+				bench.options.page_size = strtoull(optarg, NULL, 10);
+				break;
+			case 's':
+			{
+				size_t m = 0;
+				while (m < NUM_SYNC_MODES && strcmp(optarg, sync_modes[m]) != 0)
+					m++;
+				if (m == NUM_SYNC_MODES)
+					usage(argv[0]);
+				bench.options.sync = (SYNC_MODE) m;
+				break;
+			}
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (bench.records == 0 || bench.ops == 0 || bench.threads == 0 || bench.batch == 0)
+		usage(argv[0]);
+
+	/* run the workloads named on the command line, or all of them */
+	const workload_t *selected[NUM_WORKLOADS];
+	size_t n = 0;
+	for (int i = optind; i < argc; i++)
+	{
+		size_t w = 0;
+		while (w < NUM_WORKLOADS && strcmp(argv[i], workloads[w].name) != 0)
+			w++;
+		if (w == NUM_WORKLOADS || n == NUM_WORKLOADS)
+			usage(argv[0]);
+		selected[n++] = &workloads[w];
+	}
+	if (n == 0)
+		for (; n < NUM_WORKLOADS; n++)
+			selected[n] = &workloads[n];
+
+	result_t *results;
+	if ((results = calloc(n, sizeof(result_t))) == NULL)
+		return EXIT_FAILURE;
+	if (!bench.json)
+		print_text_header();
+	for (size_t i = 0; i < n; i++)
+	{
+		if (run_workload(&bench, selected[i], &results[i]) == -1)
+		{
+			fprintf(stderr, "%s: %s\n", selected[i]->name, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (!bench.json)
+			print_text(&results[i]);
+	}
+	if (bench.json)
+		print_json(&bench, results, n);
+
+	free(results);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include "btree.h"
+#include "database.h"
+#include "lock.h"
+#include "page.h"
+
+#define INCREMENT_MAGIC 0x4942444d /* "MDBI" */
+
+/*
+ * An export starts with this header, followed by the numbers of the pages it
+ * holds (count size_t, in increasing order) and then the pages themselves, in
+ * the same order.
+ */
+typedef struct increment_t
+{
+	uint32_t magic;
+	uint32_t format;        /* META_FORMAT */
+	uint64_t since;         /* pages written by this commit or before are left out */
+	uint64_t count;
+	database_file_t header; /* of the version exported */
+} increment_t;
+
+static int read_all(int fd, void *buffer, size_t size)
+{
+	char *data = buffer;
+	while (size > 0)
+	{
+		ssize_t n = read(fd, data, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		/* cut short */
+		if (n == 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t size)
+{
+	const char *data = buffer;
+	while (size > 0)
+	{
+		ssize_t n = write(fd, data, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Append @size bytes of the data file at @offset to @fd. The kernel moves
+ * them from the page cache (or shares the extents) without them passing
+ * through user space; copy_file_range only takes regular files, so anything
+ * else, such as a pipe, is fed with sendfile.
+ */
+static int copy_all(database_t *database, off_t offset, int fd, size_t size)
+{
+	int use_sendfile = 0;
+	while (size > 0)
+	{
+		ssize_t n;
+		if (!use_sendfile)
+		{
+			n = copy_file_range(database->fd, &offset, fd, NULL, size, 0);
+			if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == EBADF
+					|| errno == EOPNOTSUPP || errno == ENOSYS))
+			{
+				use_sendfile = 1;
+				continue;
+			}
+		}
+		else
+			n = sendfile(fd, database->fd, &offset, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		/* the file cannot end before the pages of a pinned version */
+		if (n == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Write the tree of @transaction to @fd as a database of its own: two meta
+ * pages naming it and then its pages breadth first, numbered in the order they
+ * are written. Only the pages that point at others are copied through a
+ * buffer, to point them at the new numbers; runs of other leaves and overflow
+ * pages that are also consecutive in the data file go out in one copy.
+ */
+static int backup_write(transaction_t *transaction, const page_list_t *pages, int fd)
+{
+	database_t *database = transaction->database;
+	size_t page_size = PAGE_SIZE(database);
+	char *buffer;
+	if ((buffer = calloc(NUM_META_PAGES, page_size)) == NULL)
+		return -1;
+
+	database_file_t header = {
+		.txnid = transaction->txnid,
+		.page_size = page_size,
+		.active_page = pages->length > 0 ? NUM_META_PAGES : P_INVALID,
+		.num_pages = NUM_META_PAGES + pages->length,
+		.free_head = P_INVALID,
+		.free_used = 0,
+		.free_tail = P_INVALID
+	};
+	for (size_t i = 0; i < NUM_META_PAGES; i++)
+		meta_init((meta_t *) (buffer + i * page_size), &header);
+	if (write_all(fd, buffer, NUM_META_PAGES * page_size) == -1)
+	{
+		free(buffer);
+		return -1;
+	}
+
+	/* the root is page NUM_META_PAGES, its children follow */
+	size_t next = NUM_META_PAGES + 1;
+	int r = 0;
+	for (size_t i = 0; r == 0 && i < pages->length;)
+	{
+		page_t *page = page_get(transaction, pages->pages[i]);
+		if (btree_links(page))
+		{
+			memcpy(buffer, page, page_size);
+			btree_renumber(transaction, (page_t *) buffer, &next);
+			r = write_all(fd, buffer, page_size);
+			i++;
+			continue;
+		}
+
+		/* the pages of an overflow run past the first have no header to look at */
+		size_t run = page_span(page);
+		while (i + run < pages->length
+				&& pages->pages[i + run] == pages->pages[i] + run
+				&& !btree_links(page = page_get(transaction, pages->pages[i + run])))
+			run += page_span(page);
+		r = copy_all(database, pages->pages[i] * page_size, fd, run * page_size);
+		i += run;
+	}
+
+	free(buffer);
+	return r;
+}
+
+int database_backup(database_t *database, int fd)
+{
+	transaction_t *transaction;
+	if ((transaction = start_transaction(database, TRANSACTION_MODE_READ)) == NULL)
+		return -1;
+
+	page_list_t pages = { 0 };
+	int r = -1;
+	if ((transaction->root == P_INVALID
+			|| btree_pages(transaction, transaction->root, 0, &pages) == 0)
+			&& backup_write(transaction, &pages, fd) == 0)
+		r = 0;
+
+	int error = errno;
+	page_list_clear(&pages);
+	commit_transaction(database, transaction);
+	errno = error;
+	return r;
+}
+
+static int number_compare(const void *a, const void *b)
+{
+	size_t x = *(const size_t *) a, y = *(const size_t *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * The freelist is exported whole: its pages are few, and the tail is linked to
+ * the next one in place rather than copied, so its stamp would not tell.
+ */
+static int export_freelist(transaction_t *transaction, const database_file_t *header,
+		page_list_t *pages)
+{
+	size_t number = header->free_head;
+	while (number != P_INVALID)
+	{
+		if (page_list_push(pages, number) == -1)
+			return -1;
+		if (number == header->free_tail)
+			break;
+		number = ((freelist_t *) page_get(transaction, number))->next;
+	}
+	return 0;
+}
+
+static int export_write(transaction_t *transaction, const database_file_t *header,
+		page_list_t *pages, size_t since, int fd)
+{
+	database_t *database = transaction->database;
+	size_t page_size = PAGE_SIZE(database);
+	qsort(pages->pages, pages->length, sizeof(size_t), number_compare);
+
+	increment_t increment = {
+		.magic = INCREMENT_MAGIC,
+		.format = META_FORMAT,
+		.since = since,
+		.count = pages->length,
+		.header = *header
+	};
+	if (write_all(fd, &increment, sizeof(increment)) == -1
+			|| write_all(fd, pages->pages, pages->length * sizeof(size_t)) == -1)
+		return -1;
+
+	for (size_t i = 0, run; i < pages->length; i += run)
+	{
+		run = 1;
+		while (i + run < pages->length && pages->pages[i + run] == pages->pages[i] + run)
+			run++;
+		if (copy_all(database, pages->pages[i] * page_size, fd, run * page_size) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+int database_export(database_t *database, int fd, size_t since, size_t *txnid)
+{
+	/*
+	 * the snapshot is taken under the writer lock, for the freelist and file
+	 * size of its version to come along
+	 */
+	transaction_t *transaction;
+	database_file_t header;
+	if (lock_writer(database) == -1)
+		return -1;
+	transaction = start_transaction(database, TRANSACTION_MODE_READ);
+	header = *database->file;
+	unlock_writer(database);
+	if (transaction == NULL)
+		return -1;
+
+	page_list_t pages = { 0 };
+	int r = -1;
+	if ((transaction->root == P_INVALID
+			|| btree_pages(transaction, transaction->root, since, &pages) == 0)
+			&& export_freelist(transaction, &header, &pages) == 0
+			&& export_write(transaction, &header, &pages, since, fd) == 0)
+	{
+		if (txnid != NULL)
+			*txnid = header.txnid;
+		r = 0;
+	}
+
+	int error = errno;
+	page_list_clear(&pages);
+	commit_transaction(database, transaction);
+	errno = error;
+	return r;
+}
+
+/* read @size bytes of @fd into the data file at @offset */
+static int restore_copy(database_t *database, int fd, off_t offset, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = copy_file_range(fd, NULL, database->fd, &offset, size, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == EBADF
+				|| errno == EOPNOTSUPP || errno == ENOSYS))
+			/* not a regular file: read straight into the mapping */
+			return read_all(fd, database->map + offset, size);
+		if (n == -1)
+			return -1;
+		if (n == 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* whether the tree of @database has no entry, as when it was just created */
+static int restore_empty(database_t *database)
+{
+	size_t root = database->file->active_page;
+	return root == P_INVALID
+			|| ((page_t *) (database->map + root * PAGE_SIZE(database)))->count == 0;
+}
+
+/*
+ * An increment has to be newer than the database, except a full export of a
+ * database as new as the empty one it goes to.
+ */
+static int restore_apply(database_t *database, int fd)
+{
+	size_t page_size = PAGE_SIZE(database);
+	increment_t increment;
+	if (read_all(fd, &increment, sizeof(increment)) == -1)
+		return -1;
+	database_file_t *header = &increment.header;
+	if (increment.magic != INCREMENT_MAGIC || increment.format != META_FORMAT
+			|| header->page_size != page_size
+			|| increment.since > database->file->txnid
+			|| header->txnid < database->file->txnid
+			|| (header->txnid == database->file->txnid
+					&& (increment.since != 0 || !restore_empty(database)))
+			|| header->num_pages > database->map_size / page_size
+			|| increment.count > header->num_pages)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t *numbers;
+	/* one more, as malloc(0) may fail */
+	if ((numbers = malloc((increment.count + 1) * sizeof(size_t))) == NULL)
+		return -1;
+	int r = read_all(fd, numbers, increment.count * sizeof(size_t));
+	for (size_t i = 0; r == 0 && i < increment.count; i++)
+	{
+		if (numbers[i] < NUM_META_PAGES || numbers[i] >= header->num_pages
+				|| (i > 0 && numbers[i] <= numbers[i - 1]))
+		{
+			errno = EINVAL;
+			r = -1;
+		}
+	}
+	if (r == 0)
+		r = file_reserve(database, header->num_pages * page_size);
+
+	for (size_t i = 0, run; r == 0 && i < increment.count; i += run)
+	{
+		run = 1;
+		while (i + run < increment.count && numbers[i + run] == numbers[i] + run)
+			run++;
+		r = restore_copy(database, fd, numbers[i] * page_size, run * page_size);
+	}
+	free(numbers);
+
+	/* as in a commit, the header only goes out once the pages are on disk */
+	if (r == 0 && (r = fdatasync(database->fd)) == 0
+			&& (r = lock_mutex(&database->lock->flush_lock)) == 0)
+	{
+		*database->file = *header;
+		meta_store(database, header);
+		unlock_mutex(&database->lock->flush_lock);
+		r = fdatasync(database->fd);
+	}
+	return r;
+}
+
+int database_restore(database_t *database, int fd)
+{
+	if (lock_writer(database) == -1)
+		return -1;
+
+	int r = -1;
+	if (lock_exclusive(database) == 0)
+	{
+		if (reader_oldest(database) != SIZE_MAX)
+			errno = EBUSY;
+		else
+			r = restore_apply(database, fd);
+		int error = errno;
+		lock_ready(database);
+		errno = error;
+	}
+
+	unlock_writer(database);
+	return r;
+}
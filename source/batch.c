@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include "database.h"
+
+#define BATCH_INIT 4096
+
+/* value_size of a delete */
+#define BATCH_DELETE SIZE_MAX
+
+/* an operation as buffered, followed by its key and value */
+typedef struct batch_entry_t
+{
+	size_t sequence; /* order of the operation in the batch */
+	size_t key_size;
+	size_t value_size;
+	char data[];
+} batch_entry_t;
+
+struct db_batch_t
+{
+	database_t *database;
+	char *buffer;  /* the entries, each aligned for the next */
+	size_t length; /* bytes of buffer used */
+	size_t volume; /* sizeof buffer */
+	size_t count;  /* entries in buffer */
+};
+
+static size_t entry_align(size_t size)
+{
+	return (size + alignof(batch_entry_t) - 1) & ~(alignof(batch_entry_t) - 1);
+}
+
+static int batch_add(db_batch_t *batch, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	size_t data_size = key_size + (value_size == BATCH_DELETE ? 0 : value_size);
+	size_t size = entry_align(sizeof(batch_entry_t) + data_size);
+	if (batch->length + size > batch->volume)
+	{
+		size_t volume = batch->volume ? batch->volume : BATCH_INIT;
+		while (volume < batch->length + size)
+			volume *= 2;
+		char *buffer;
+		if ((buffer = realloc(batch->buffer, volume)) == NULL)
+			return -1;
+		batch->buffer = buffer;
+		batch->volume = volume;
+	}
+
+	batch_entry_t *entry = (batch_entry_t *) (batch->buffer + batch->length);
+	entry->sequence = batch->count++;
+	entry->key_size = key_size;
+	entry->value_size = value_size;
+	memcpy(entry->data, key, key_size);
+	if (value_size != BATCH_DELETE)
+		memcpy(entry->data + key_size, value, value_size);
+	batch->length += size;
+	return 0;
+}
+
+/* by key, and operations on the same key in the order they were made */
+static int entry_compare(const void *a, const void *b)
+{
+	const batch_entry_t *x = *(const batch_entry_t **) a;
+	const batch_entry_t *y = *(const batch_entry_t **) b;
+	size_t size = x->key_size < y->key_size ? x->key_size : y->key_size;
+	int r = memcmp(x->data, y->data, size);
+	if (r != 0)
+		return r;
+	if (x->key_size != y->key_size)
+		return x->key_size < y->key_size ? -1 : 1;
+	return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+/*
+ * Apply the last operation made on each key, in key order: consecutive
+ * operations mostly land in the leaf the previous one copied already, so each
+ * page on the way is copied and allocated once for the whole batch.
+ */
+static int batch_apply(transaction_t *transaction, batch_entry_t **entries, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		batch_entry_t *entry = entries[i];
+		if (i + 1 < count && entries[i + 1]->key_size == entry->key_size
+				&& memcmp(entries[i + 1]->data, entry->data, entry->key_size) == 0)
+			continue;
+
+		if (entry->value_size == BATCH_DELETE)
+		{
+			if (db_del(transaction, entry->data, entry->key_size) == -1 && errno != ENOENT)
+				return -1;
+		}
+		else if (db_put(transaction, entry->data, entry->key_size,
+				entry->data + entry->key_size, entry->value_size) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+db_batch_t *db_batch_new(database_t *database)
+{
+	db_batch_t *batch;
+	if ((batch = calloc(1, sizeof(db_batch_t))) == NULL)
+		return NULL;
+	batch->database = database;
+	return batch;
+}
+
+void db_batch_free(db_batch_t *batch)
+{
+	free(batch->buffer);
+	free(batch);
+}
+
+int db_batch_put(db_batch_t *batch, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	return batch_add(batch, key, key_size, value, value_size);
+}
+
+int db_batch_del(db_batch_t *batch, const void *key, size_t key_size)
+{
+	return batch_add(batch, key, key_size, NULL, BATCH_DELETE);
+}
+
+void db_batch_clear(db_batch_t *batch)
+{
+	batch->length = 0;
+	batch->count = 0;
+}
+
+int db_batch_write(db_batch_t *batch)
+{
+	batch_entry_t **entries;
+	/* one more, as malloc(0) may fail */
+	if ((entries = malloc((batch->count + 1) * sizeof(batch_entry_t *))) == NULL)
+		return -1;
+	for (size_t i = 0, offset = 0; i < batch->count; i++)
+	{
+		entries[i] = (batch_entry_t *) (batch->buffer + offset);
+		offset += entry_align(sizeof(batch_entry_t) + entries[i]->key_size
+				+ (entries[i]->value_size == BATCH_DELETE ? 0 : entries[i]->value_size));
+	}
+	qsort(entries, batch->count, sizeof(batch_entry_t *), entry_compare);
+
+	transaction_t *transaction;
+	int r = -1;
+	if ((transaction = start_transaction(batch->database, TRANSACTION_MODE_RW)) != NULL)
+	{
+		if ((r = batch_apply(transaction, entries, batch->count)) == 0)
+			r = commit_transaction(batch->database, transaction);
+		else
+		{
+			int error = errno;
+			cancel_transaction(batch->database, transaction);
+			errno = error;
+		}
+	}
+	free(entries);
+	if (r == 0)
+		db_batch_clear(batch);
+	return r;
+}
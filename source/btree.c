@@ -0,0 +1,1860 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "search.h"
+
+/* entries are padded so that their headers can be accessed in place */
+#define ENTRY_ALIGN 8
+
+/*
+ * The slot of an entry is its key head (see search.h) and the offset of the
+ * entry in the page. The heads come first, in one array that can be searched
+ * with vector compares, and the offsets right after them:
+ *
+ *   page_t | prefix | heads (uint32_t) | offsets (uint16_t) | free | entries
+ *
+ * A head holds the 4 bytes of the key that follow the prefix all the keys of
+ * the page share, zero-padded, so comparing heads orders keys except between
+ * ones with the same head. The key of slot 0 of a branch has no head.
+ *
+ * Leaves are prefix compressed: the prefix is stored once, padded to 4 bytes,
+ * and their entries only hold the rest of their keys. It is chosen whenever a
+ * leaf is laid out anew and a key that does not start with it has the leaf
+ * laid out again. Branches keep whole keys and store no prefix. As every slot
+ * leads straight to its key, the search needs no restart points.
+ */
+#define SLOT_SIZE (sizeof(uint32_t) + sizeof(uint16_t))
+#define HEAD_BYTES 4
+
+/*
+ * A value that would not let its entry fit in half a page is stored in an
+ * overflow run (see overflow_t) and the entry holds the number of its first
+ * page instead, with LEAF_OVERFLOW set in its value_size. Moving such an entry
+ * around, as splits and merges do, never copies the value itself.
+ */
+#define LEAF_OVERFLOW UINT32_C(0x80000000)
+
+typedef struct leaf_t
+{
+	uint32_t key_size;
+	uint32_t value_size; /* of the value, with LEAF_OVERFLOW if it overflows */
+	char data[]; /* key followed by value, or the page of the value (unaligned) */
+} leaf_t;
+
+typedef struct branch_t
+{
+	uint64_t child;
+	uint32_t key_size; /* the key of slot 0 is never looked at */
+	char data[];
+} branch_t;
+
+static size_t entry_align(size_t size)
+{
+	return (size + ENTRY_ALIGN - 1) & ~((size_t) ENTRY_ALIGN - 1);
+}
+
+/* bytes an entry with @value_size (as leaf_t has it) holds after its key */
+static size_t value_stored(size_t value_size)
+{
+	return (value_size & LEAF_OVERFLOW) ? sizeof(uint64_t) : value_size;
+}
+
+static size_t leaf_size(size_t key_size, size_t value_size)
+{
+	return entry_align(offsetof(leaf_t, data) + key_size + value_stored(value_size));
+}
+
+static size_t branch_size(size_t key_size)
+{
+	return entry_align(offsetof(branch_t, data) + key_size);
+}
+
+/* bytes available to slots and entries in a page */
+static size_t page_usable(transaction_t *transaction)
+{
+	return PAGE_SIZE(transaction->database) - sizeof(page_t);
+}
+
+/* bytes taken by the slots and entries of @page */
+static size_t page_used(transaction_t *transaction, page_t *page)
+{
+	return page_usable(transaction) - (page->upper - page->lower);
+}
+
+/* bytes of the keys of @page its entries leave out */
+static size_t page_stripped(page_t *page)
+{
+	return (page->flags & PAGE_LEAF) ? page->prefix : 0;
+}
+
+/* bytes the prefix of a leaf with @prefix takes in it */
+static size_t prefix_stored(size_t prefix)
+{
+	return (prefix + 3) & ~(size_t) 3;
+}
+
+static uint32_t *page_heads(page_t *page)
+{
+	return (uint32_t *) (page->data + prefix_stored(page_stripped(page)));
+}
+
+static uint16_t *page_offsets(page_t *page)
+{
+	return (uint16_t *) (page_heads(page) + page->count);
+}
+
+static void *page_entry(page_t *page, size_t i)
+{
+	return (char *) page + page_offsets(page)[i];
+}
+
+static leaf_t *leaf_at(page_t *page, size_t i)
+{
+	return page_entry(page, i);
+}
+
+static branch_t *branch_at(page_t *page, size_t i)
+{
+	return page_entry(page, i);
+}
+
+static size_t entry_size(page_t *page, size_t i)
+{
+	if (page->flags & PAGE_BRANCH)
+		return branch_size(branch_at(page, i)->key_size);
+	leaf_t *leaf = leaf_at(page, i);
+	return leaf_size(leaf->key_size, leaf->value_size);
+}
+
+static void entry_key(page_t *page, size_t i, const void **key, size_t *key_size)
+{
+	if (page->flags & PAGE_BRANCH)
+	{
+		branch_t *branch = branch_at(page, i);
+		*key = branch->data;
+		*key_size = branch->key_size;
+	}
+	else
+	{
+		leaf_t *leaf = leaf_at(page, i);
+		*key = leaf->data;
+		*key_size = leaf->key_size;
+	}
+}
+
+static int key_compare(const void *a, size_t a_size, const void *b, size_t b_size)
+{
+	size_t size = a_size < b_size ? a_size : b_size;
+	int r = size ? memcmp(a, b, size) : 0;
+	if (r != 0)
+		return r;
+	return (a_size > b_size) - (a_size < b_size);
+}
+
+/* the head of @key in a page whose keys share @prefix bytes */
+static uint32_t key_head(const void *key, size_t key_size, size_t prefix)
+{
+	const unsigned char *bytes = key;
+	uint32_t head = 0;
+	for (size_t i = prefix; i < prefix + HEAD_BYTES; i++)
+		head = head << 8 | (i < key_size ? bytes[i] : 0);
+	return head ^ HEAD_BIAS;
+}
+
+/* the number of bytes, up to @limit, that @a and @b start with alike */
+static size_t key_shared(const void *a, size_t a_size, const void *b, size_t limit)
+{
+	const unsigned char *x = a, *y = b;
+	if (a_size < limit)
+		limit = a_size;
+	size_t i = 0;
+	while (i < limit && x[i] == y[i])
+		i++;
+	return i;
+}
+
+/* whether the entry of @key_size and @value_size keeps its value in an overflow run */
+static int value_overflows(transaction_t *transaction, size_t key_size, size_t value_size)
+{
+	return leaf_size(key_size, value_size) + SLOT_SIZE > page_usable(transaction) / 2;
+}
+
+/*
+ * every entry must fit in half a page for splits to always succeed, even with
+ * its value in an overflow run, and values must leave LEAF_OVERFLOW alone (E2BIG)
+ */
+static int entry_too_big(transaction_t *transaction, size_t key_size, size_t value_size)
+{
+	if (value_size >= LEAF_OVERFLOW
+			|| leaf_size(key_size, LEAF_OVERFLOW) + SLOT_SIZE > page_usable(transaction) / 2
+			|| branch_size(key_size) + SLOT_SIZE > page_usable(transaction) / 2)
+	{
+		errno = E2BIG;
+		return 1;
+	}
+	return 0;
+}
+
+static void page_init(transaction_t *transaction, page_t *page, uint16_t flags)
+{
+	/* only pages owned by the running transaction are ever (re)initialized */
+	page->flags = flags | PAGE_DIRTY;
+	page->count = 0;
+	page->lower = sizeof(page_t);
+	page->upper = PAGE_SIZE(transaction->database);
+	page->prefix = 0;
+	page->txnid = 0;
+}
+
+/*
+ * Return the index of the first entry of @page from slot @low on whose key is
+ * not less than @key and set *exact if it is equal. The heads narrow the
+ * search down to the entries whose head is the one of @key, which are few,
+ * and only their keys are compared.
+ */
+static size_t page_search_from(page_t *page, size_t low, const void *key,
+		size_t key_size, int *exact)
+{
+	size_t high = page->count;
+	*exact = 0;
+	if (low < high)
+	{
+		/* a key that does not start with the prefix of the page is outside it */
+		const void *first = page->data;
+		size_t first_size, prefix = page->prefix;
+		if (page->flags & PAGE_BRANCH)
+			entry_key(page, low, &first, &first_size);
+		size_t size = key_size < prefix ? key_size : prefix;
+		int r = size ? memcmp(key, first, size) : 0;
+		if (r < 0 || (r == 0 && key_size < prefix))
+			return low;
+		if (r > 0)
+			return high;
+
+		/* from here on, keys are compared as the entries hold them */
+		size_t stripped = page_stripped(page);
+		key = (const char *) key + stripped;
+		key_size -= stripped;
+		size_t less, equal;
+		heads_count(page_heads(page) + low, high - low,
+				key_head(key, key_size, prefix - stripped), &less, &equal);
+		low += less;
+		high = low + equal;
+	}
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		const void *mid_key;
+		size_t mid_size;
+		entry_key(page, mid, &mid_key, &mid_size);
+		int r = key_compare(mid_key, mid_size, key, key_size);
+		if (r < 0)
+			low = mid + 1;
+		else
+		{
+			*exact = (r == 0);
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+ * Return the index of the first entry of @page whose key is not less than
+ * @key and set *exact if it is equal. Slot 0 of a branch is the lower bound of
+ * the page and is skipped.
+ */
+static size_t page_search(page_t *page, const void *key, size_t key_size, int *exact)
+{
+	return page_search_from(page, (page->flags & PAGE_BRANCH) ? 1 : 0, key, key_size,
+			exact);
+}
+
+/* return the slot of the child of branch @page that covers @key */
+static size_t branch_search(page_t *page, const void *key, size_t key_size)
+{
+	int exact;
+	size_t i = page_search(page, key, key_size, &exact);
+	return exact ? i : i - 1;
+}
+
+/*
+ * Make room for an entry of @size bytes at slot @i and return its address. The
+ * caller writes the entry and then sets its head with page_head_set.
+ */
+static void *page_reserve(page_t *page, size_t i, size_t size)
+{
+	uint32_t *heads = page_heads(page);
+	uint16_t *offsets = page_offsets(page);
+	/* the offsets move past the new head, the ones from @i on a slot further */
+	uint16_t *moved = (uint16_t *) (heads + page->count + 1);
+	memmove(moved + i + 1, offsets + i, (page->count - i) * sizeof(uint16_t));
+	memmove(moved, offsets, i * sizeof(uint16_t));
+	memmove(heads + i + 1, heads + i, (page->count - i) * sizeof(uint32_t));
+
+	page->upper -= size;
+	heads[i] = HEAD_BIAS;
+	moved[i] = page->upper;
+	page->count += 1;
+	page->lower += SLOT_SIZE;
+	return (char *) page + page->upper;
+}
+
+/* remove the entry at slot @i and close the gap it leaves */
+static void page_remove(page_t *page, size_t i)
+{
+	char *base = (char *) page;
+	uint32_t *heads = page_heads(page);
+	uint16_t *offsets = page_offsets(page);
+	size_t offset = offsets[i];
+	size_t size = entry_size(page, i);
+
+	memmove(base + page->upper + size, base + page->upper, offset - page->upper);
+	for (size_t j = 0; j < page->count; j++)
+	{
+		if (offsets[j] < offset)
+			offsets[j] += size;
+	}
+	memmove(heads + i, heads + i + 1, (page->count - i - 1) * sizeof(uint32_t));
+	uint16_t *moved = (uint16_t *) (heads + page->count - 1);
+	memmove(moved, offsets, i * sizeof(uint16_t));
+	memmove(moved + i, offsets + i + 1, (page->count - i - 1) * sizeof(uint16_t));
+	page->count -= 1;
+	page->lower -= SLOT_SIZE;
+	page->upper += size;
+	/* the keys left still share the prefix, if not a longer one */
+}
+
+static int page_fits(page_t *page, size_t size)
+{
+	return size + SLOT_SIZE <= page->upper - page->lower;
+}
+
+/* recompute every head of a branch, after its prefix changed */
+static void page_heads_update(page_t *page)
+{
+	for (size_t j = 1; j < page->count; j++)
+	{
+		const void *key;
+		size_t key_size;
+		entry_key(page, j, &key, &key_size);
+		page_heads(page)[j] = key_head(key, key_size, page->prefix);
+	}
+}
+
+/*
+ * Set the head of the entry written at slot @i. The prefix of a leaf is set
+ * before its entries are written; a key that does not start with the whole
+ * prefix of a branch shortens it instead, which changes every head.
+ */
+static void page_head_set(page_t *page, size_t i)
+{
+	size_t first = (page->flags & PAGE_BRANCH) ? 1 : 0;
+	if (i < first)
+		return;
+	const void *key;
+	size_t key_size;
+	entry_key(page, i, &key, &key_size);
+	if (!(page->flags & PAGE_BRANCH))
+	{
+		page_heads(page)[i] = key_head(key, key_size, 0);
+		return;
+	}
+
+	if (page->count == 2)
+		page->prefix = key_size;
+	else
+	{
+		/* all the other keys start with the prefix, so any of them tells */
+		const void *other;
+		size_t other_size;
+		entry_key(page, i == 1 ? 2 : 1, &other, &other_size);
+		size_t shared = key_shared(key, key_size, other, page->prefix);
+		if (shared < page->prefix)
+		{
+			page->prefix = shared;
+			page_heads_update(page);
+			return;
+		}
+	}
+	page_heads(page)[i] = key_head(key, key_size, page->prefix);
+}
+
+static void leaf_write(leaf_t *leaf, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	leaf->key_size = key_size;
+	leaf->value_size = value_size;
+	if (key_size > 0)
+		memcpy(leaf->data, key, key_size);
+	if (value_stored(value_size) > 0)
+		memcpy(leaf->data + key_size, value, value_stored(value_size));
+}
+
+static void branch_write(branch_t *branch, const void *key, size_t key_size,
+		size_t child)
+{
+	branch->child = child;
+	branch->key_size = key_size;
+	if (key_size > 0)
+		memcpy(branch->data, key, key_size);
+}
+
+/* insert the formatted @entry of @size bytes at slot @i of @page */
+static void page_insert(page_t *page, size_t i, const void *entry, size_t size)
+{
+	memcpy(page_reserve(page, i, size), entry, size);
+	page_head_set(page, i);
+}
+
+static void leaf_insert(page_t *page, size_t i, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	leaf_write(page_reserve(page, i, leaf_size(key_size, value_size)), key, key_size,
+			value, value_size);
+	page_head_set(page, i);
+}
+
+static void branch_insert(page_t *page, size_t i, const void *key, size_t key_size,
+		size_t child)
+{
+	branch_write(page_reserve(page, i, branch_size(key_size)), key, key_size, child);
+	page_head_set(page, i);
+}
+
+/* the first page of the overflow run of @leaf */
+static size_t leaf_overflow(leaf_t *leaf)
+{
+	uint64_t number;
+	memcpy(&number, leaf->data + leaf->key_size, sizeof(number));
+	return number;
+}
+
+/* point *@value at the value of @leaf, in its overflow run if it has one */
+static void leaf_value(transaction_t *transaction, leaf_t *leaf, const void **value,
+		size_t *value_size)
+{
+	if (leaf->value_size & LEAF_OVERFLOW)
+		*value = ((overflow_t *) page_get(transaction, leaf_overflow(leaf)))->data;
+	else
+		*value = leaf->data + leaf->key_size;
+	*value_size = leaf->value_size & ~LEAF_OVERFLOW;
+}
+
+/* store @value in a new overflow run and set *@number to its first page */
+static int overflow_new(transaction_t *transaction, const void *value, size_t value_size,
+		uint64_t *number)
+{
+	size_t page_size = PAGE_SIZE(transaction->database);
+	size_t count = (offsetof(overflow_t, data) + value_size + page_size - 1) / page_size;
+	size_t first;
+	if ((first = page_allocate_run(transaction, count)) == P_INVALID)
+		return -1;
+	overflow_t *overflow = (overflow_t *) page_get(transaction, first);
+	overflow->flags = PAGE_OVERFLOW | PAGE_DIRTY;
+	overflow->reserved = 0;
+	overflow->count = count;
+	overflow->size = value_size;
+	overflow->txnid = 0;
+	memcpy(overflow->data, value, value_size);
+	*number = first;
+	return 0;
+}
+
+/* release the overflow run of @leaf, if it has one */
+static int overflow_free(transaction_t *transaction, leaf_t *leaf)
+{
+	if (!(leaf->value_size & LEAF_OVERFLOW))
+		return 0;
+	size_t number = leaf_overflow(leaf);
+	return page_free_run(transaction, number,
+			((overflow_t *) page_get(transaction, number))->count);
+}
+
+/*
+ * A leaf entry on its way to a leaf laid out anew. Its key is @head followed
+ * by @tail: the prefix of the leaf it comes from and the rest it holds.
+ */
+typedef struct record_t
+{
+	const char *head;
+	size_t head_size;
+	const char *tail;
+	size_t tail_size;
+	const char *value;
+	size_t value_size;
+} record_t;
+
+static record_t leaf_record(page_t *page, size_t i)
+{
+	leaf_t *leaf = leaf_at(page, i);
+	return (record_t) { page->data, page->prefix, leaf->data, leaf->key_size,
+			leaf->data + leaf->key_size, leaf->value_size };
+}
+
+static record_t record_new(const void *key, size_t key_size, const void *value,
+		size_t value_size)
+{
+	return (record_t) { key, key_size, NULL, 0, value, value_size };
+}
+
+static size_t record_key_size(const record_t *record)
+{
+	return record->head_size + record->tail_size;
+}
+
+/* copy the bytes of the key of @record from @from to @to into @key */
+static void record_copy(const record_t *record, size_t from, size_t to, char *key)
+{
+	if (from < to && from < record->head_size)
+	{
+		size_t size = (to < record->head_size ? to : record->head_size) - from;
+		memcpy(key, record->head + from, size);
+		key += size;
+		from += size;
+	}
+	if (from < to)
+		memcpy(key, record->tail + (from - record->head_size), to - from);
+}
+
+/* compare the key of @record with @key */
+static int record_compare(const record_t *record, const void *key, size_t key_size)
+{
+	size_t size = record->head_size < key_size ? record->head_size : key_size;
+	int r = size ? memcmp(record->head, key, size) : 0;
+	if (r != 0 || key_size < record->head_size)
+		return r != 0 ? r : 1;
+	return key_compare(record->tail, record->tail_size,
+			(const char *) key + record->head_size, key_size - record->head_size);
+}
+
+/* the number of bytes the keys of @a and @b start with alike */
+static size_t record_shared(const record_t *a, const record_t *b)
+{
+	size_t limit = record_key_size(a) < record_key_size(b)
+			? record_key_size(a) : record_key_size(b);
+	size_t i = 0;
+	while (i < limit)
+	{
+		char x = i < a->head_size ? a->head[i] : a->tail[i - a->head_size];
+		char y = i < b->head_size ? b->head[i] : b->tail[i - b->head_size];
+		if (x != y)
+			break;
+		i++;
+	}
+	return i;
+}
+
+/* bytes taken by the @count @records in a leaf with @prefix */
+static size_t leaf_layout(const record_t *records, size_t count, size_t prefix)
+{
+	size_t size = prefix_stored(prefix);
+	for (size_t j = 0; j < count; j++)
+		size += leaf_size(record_key_size(&records[j]) - prefix, records[j].value_size)
+				+ SLOT_SIZE;
+	return size;
+}
+
+/*
+ * Set *@prefix to the prefix that packs the @count @records best: the one
+ * they all share or, should its padding and the entries' not make up for it,
+ * @hint, which they share too. Return the bytes they then take.
+ */
+static size_t leaf_choose(const record_t *records, size_t count, size_t hint,
+		size_t *prefix)
+{
+	*prefix = record_shared(&records[0], &records[count - 1]);
+	size_t size = leaf_layout(records, count, *prefix);
+	size_t other = leaf_layout(records, count, hint);
+	if (other < size)
+	{
+		*prefix = hint;
+		size = other;
+	}
+	return size;
+}
+
+/*
+ * Lay the @count @records, in order and pointing elsewhere, out in @page as a
+ * leaf of its own, unless they take more than @limit bytes (return 1).
+ */
+static int leaf_build(transaction_t *transaction, page_t *page, const record_t *records,
+		size_t count, size_t hint, size_t limit)
+{
+	size_t prefix;
+	if (leaf_choose(records, count, hint, &prefix) > limit)
+		return 1;
+
+	page_init(transaction, page, PAGE_LEAF);
+	page->prefix = prefix;
+	record_copy(&records[0], 0, prefix, page->data);
+	page->lower += prefix_stored(prefix);
+	for (size_t j = 0; j < count; j++)
+	{
+		const record_t *record = &records[j];
+		size_t key_size = record_key_size(record) - prefix;
+		leaf_t *leaf = page_reserve(page, j, leaf_size(key_size, record->value_size));
+		leaf->key_size = key_size;
+		leaf->value_size = record->value_size;
+		record_copy(record, prefix, record_key_size(record), leaf->data);
+		if (value_stored(record->value_size) > 0)
+			memcpy(leaf->data + key_size, record->value, value_stored(record->value_size));
+		page_head_set(page, j);
+	}
+	return 0;
+}
+
+/*
+ * Gather the records of the entries of leaf @page, copied to @copy, with the
+ * one of @key put at slot @i if @key is not NULL.
+ */
+static record_t *leaf_records(transaction_t *transaction, page_t *page, char *copy,
+		size_t i, const void *key, size_t key_size, const void *value, size_t value_size)
+{
+	size_t count = page->count + (key != NULL);
+	record_t *records;
+	/* one more, as malloc(0) may fail */
+	if ((records = malloc((count + 1) * sizeof(record_t))) == NULL)
+		return NULL;
+	memcpy(copy, page, PAGE_SIZE(transaction->database));
+	for (size_t j = 0, k = 0; j < count; j++)
+	{
+		if (key != NULL && j == i)
+			records[j] = record_new(key, key_size, value, value_size);
+		else
+			records[j] = leaf_record((page_t *) copy, k++);
+	}
+	return records;
+}
+
+/* gather the records of the leaves @left and @right, in order */
+static void leaf_pair(page_t *left, page_t *right, record_t *records)
+{
+	for (size_t j = 0; j < left->count; j++)
+		records[j] = leaf_record(left, j);
+	for (size_t j = 0; j < right->count; j++)
+		records[left->count + j] = leaf_record(right, j);
+}
+
+/* whether @key starts with the prefix of the non-empty leaf @page */
+static int leaf_shares(page_t *page, const void *key, size_t key_size)
+{
+	return page->count > 0 && key_size >= page->prefix
+			&& (page->prefix == 0 || memcmp(key, page->data, page->prefix) == 0);
+}
+
+/*
+ * Insert @key and @value at slot @i of the leaf @page, unless the leaf would
+ * then take more than @limit bytes (return 1). A key that does not start with
+ * the prefix of the leaf, which can only go first or last, has the leaf laid
+ * out anew with the prefix they all share.
+ */
+static int leaf_add(transaction_t *transaction, page_t *page, size_t i, const void *key,
+		size_t key_size, const void *value, size_t value_size, size_t limit)
+{
+	if (leaf_shares(page, key, key_size))
+	{
+		size_t prefix = page->prefix;
+		size_t size = leaf_size(key_size - prefix, value_size);
+		if (page_used(transaction, page) + size + SLOT_SIZE > limit || !page_fits(page, size))
+			return 1;
+		leaf_insert(page, i, (const char *) key + prefix, key_size - prefix, value,
+				value_size);
+		return 0;
+	}
+
+	char *copy;
+	record_t *records;
+	if ((copy = malloc(PAGE_SIZE(transaction->database))) == NULL)
+		return -1;
+	if ((records = leaf_records(transaction, page, copy, i, key, key_size, value,
+			value_size)) == NULL)
+	{
+		free(copy);
+		return -1;
+	}
+	int r = leaf_build(transaction, page, records, page->count + 1, 0, limit);
+	free(records);
+	free(copy);
+	return r;
+}
+
+/*
+ * Make page @*number writable by the transaction. A page that belongs to a
+ * published version is copied to a new page and released; *number is updated
+ * to the copy, which the caller must link into the parent. Only the header,
+ * the slots and the entries are copied, not the free space between them.
+ */
+static int page_writable(transaction_t *transaction, size_t *number)
+{
+	page_t *page = page_get(transaction, *number);
+	if (page->flags & PAGE_DIRTY)
+		return 0;
+
+	size_t number_copy;
+	if ((number_copy = page_allocate(transaction)) == P_INVALID)
+		return -1;
+	page_t *copy = page_get(transaction, number_copy);
+	memcpy(copy, page, page->lower);
+	memcpy((char *) copy + page->upper, (char *) page + page->upper,
+			PAGE_SIZE(transaction->database) - page->upper);
+	copy->flags |= PAGE_DIRTY;
+	if (page_free(transaction, *number) == -1)
+		return -1;
+	*number = number_copy;
+	return 0;
+}
+
+/* find the pages from the root to the leaf that covers @key, copying nothing */
+static int path_find(transaction_t *transaction, const void *key, size_t key_size,
+		path_t *path)
+{
+	size_t number = transaction->root;
+	path->depth = 0;
+	for (;;)
+	{
+		page_t *page = page_get(transaction, number);
+		path->page[path->depth] = number;
+		if (page->flags & PAGE_LEAF)
+			break;
+
+		size_t i = branch_search(page, key, key_size);
+		path->index[path->depth++] = i;
+		if (path->depth == BTREE_MAX_DEPTH)
+		{
+			errno = EOVERFLOW;
+			return -1;
+		}
+		number = branch_at(page, i)->child;
+	}
+	path->depth += 1;
+	return 0;
+}
+
+/*
+ * Make every page of @path writable, linking each copy into its (already
+ * writable) parent. Called only once the modification is known to happen, so
+ * that lookups that end up changing nothing copy nothing.
+ */
+static int path_writable(transaction_t *transaction, path_t *path)
+{
+	if (page_writable(transaction, &transaction->root) == -1)
+		return -1;
+	path->page[0] = transaction->root;
+
+	for (size_t level = 1; level < path->depth; level++)
+	{
+		if (page_writable(transaction, &path->page[level]) == -1)
+			return -1;
+		page_t *parent = page_get(transaction, path->page[level - 1]);
+		branch_at(parent, path->index[level - 1])->child = path->page[level];
+	}
+	return 0;
+}
+
+/* whether the path runs down the right edge of the tree above @level */
+static int path_rightmost(transaction_t *transaction, path_t *path, size_t level)
+{
+	for (size_t l = 0; l < level; l++)
+	{
+		if (path->index[l] + 1 != page_get(transaction, path->page[l])->count)
+			return 0;
+	}
+	return 1;
+}
+
+static int branch_split(transaction_t *transaction, path_t *path, size_t level,
+		size_t index, const void *entry, size_t size);
+
+/* link the page @right, split off the page at @level, into the parent level */
+static int split_link(transaction_t *transaction, path_t *path, size_t level,
+		const void *key, size_t key_size, size_t right)
+{
+	size_t size = branch_size(key_size);
+	branch_t *separator;
+	if ((separator = malloc(size)) == NULL)
+		return -1;
+	branch_write(separator, key, key_size, right);
+
+	int r = 0;
+	if (level == 0)
+	{
+		/* the root was split: grow the tree by one level */
+		size_t root;
+		if ((root = page_allocate(transaction)) == P_INVALID)
+		{
+			free(separator);
+			return -1;
+		}
+		page_t *page = page_get(transaction, root);
+		page_init(transaction, page, PAGE_BRANCH);
+		branch_insert(page, 0, NULL, 0, path->page[0]);
+		page_insert(page, 1, separator, size);
+		transaction->root = root;
+	}
+	else
+	{
+		page_t *parent = page_get(transaction, path->page[level - 1]);
+		size_t i = path->index[level - 1] + 1;
+		if (page_fits(parent, size))
+			page_insert(parent, i, separator, size);
+		else
+			r = branch_split(transaction, path, level - 1, i, separator, size);
+	}
+	free(separator);
+	return r;
+}
+
+/*
+ * Pick where to split @n entries of @sizes bytes, the one at @index being
+ * inserted, between two pages that each also take @fixed bytes: the slot that
+ * balances them best. An insertion at the right edge of the tree is taken to
+ * be a sequential load and leaves the left page full instead. The first key of
+ * the right page of a branch moves up, leaving an entry without a key.
+ */
+static size_t split_point(transaction_t *transaction, path_t *path, size_t level,
+		size_t index, const size_t *sizes, size_t n, size_t fixed, int branch)
+{
+	size_t total = 0;
+	for (size_t j = 0; j < n; j++)
+		total += sizes[j] + SLOT_SIZE;
+
+	size_t split = 0, best = SIZE_MAX, left_used = 0;
+	for (size_t s = 1; s < n; s++)
+	{
+		left_used += sizes[s - 1] + SLOT_SIZE;
+		size_t right_used = total - left_used;
+		if (branch)
+			right_used = right_used - sizes[s] + branch_size(0);
+		if (fixed + left_used > page_usable(transaction)
+				|| fixed + right_used > page_usable(transaction))
+			continue;
+		size_t worst = left_used > right_used ? left_used : right_used;
+		if (s == n - 1 && index == n - 1 && path_rightmost(transaction, path, level))
+			return s;
+		if (worst < best)
+		{
+			best = worst;
+			split = s;
+		}
+	}
+	return split;
+}
+
+/*
+ * Split the branch at @level of @path in two while inserting the formatted
+ * @entry of @size bytes at slot @index, then link the new right page into the
+ * parent (splitting it in turn if necessary).
+ */
+static int branch_split(transaction_t *transaction, path_t *path, size_t level,
+		size_t index, const void *entry, size_t size)
+{
+	size_t right_number;
+	if ((right_number = page_allocate(transaction)) == P_INVALID)
+		return -1;
+
+	page_t *page = page_get(transaction, path->page[level]);
+	page_t *right = page_get(transaction, right_number);
+	size_t n = page->count + 1;
+
+	char *copy = malloc(PAGE_SIZE(transaction->database));
+	const char **entries = malloc(n * sizeof(*entries));
+	size_t *sizes = malloc(n * sizeof(*sizes));
+	if (copy == NULL || entries == NULL || sizes == NULL)
+	{
+		free(copy);
+		free(entries);
+		free(sizes);
+		return -1;
+	}
+	memcpy(copy, page, PAGE_SIZE(transaction->database));
+
+	for (size_t j = 0; j < n; j++)
+	{
+		if (j == index)
+		{
+			entries[j] = entry;
+			sizes[j] = size;
+		}
+		else
+		{
+			size_t k = j < index ? j : j - 1;
+			entries[j] = page_entry((page_t *) copy, k);
+			sizes[j] = entry_size((page_t *) copy, k);
+		}
+	}
+	size_t split = split_point(transaction, path, level, index, sizes, n, 0, 1);
+
+	page_init(transaction, page, PAGE_BRANCH);
+	page_init(transaction, right, PAGE_BRANCH);
+	for (size_t j = 0; j < split; j++)
+		page_insert(page, j, entries[j], sizes[j]);
+
+	/* the first key of the right page moves up into the parent */
+	const branch_t *first = (const branch_t *) entries[split];
+	branch_insert(right, 0, NULL, 0, first->child);
+	for (size_t j = split + 1; j < n; j++)
+		page_insert(right, right->count, entries[j], sizes[j]);
+
+	int r = split_link(transaction, path, level, first->data, first->key_size,
+			right_number);
+	free(copy);
+	free(entries);
+	free(sizes);
+	return r;
+}
+
+/*
+ * Split the leaf at @level of @path in two while inserting @key and @value at
+ * slot @index, then link the new right page into the parent. A key that does
+ * not start with the prefix of the leaf, which then did not have room for it
+ * laid out anew, gets a leaf of its own: the others still fit with it.
+ */
+static int leaf_split(transaction_t *transaction, path_t *path, size_t level,
+		size_t index, const void *key, size_t key_size, const void *value,
+		size_t value_size)
+{
+	size_t right_number;
+	if ((right_number = page_allocate(transaction)) == P_INVALID)
+		return -1;
+
+	page_t *page = page_get(transaction, path->page[level]);
+	page_t *right = page_get(transaction, right_number);
+	size_t n = page->count + 1;
+	size_t prefix = page->prefix;
+	int shares = leaf_shares(page, key, key_size);
+
+	char *copy = malloc(PAGE_SIZE(transaction->database));
+	size_t *sizes = malloc(n * sizeof(*sizes));
+	record_t *records = NULL;
+	char *separator = NULL;
+	if (copy == NULL || sizes == NULL
+			|| (records = leaf_records(transaction, page, copy, index, key, key_size,
+					value, value_size)) == NULL)
+	{
+		free(copy);
+		free(sizes);
+		return -1;
+	}
+
+	size_t split;
+	if (shares)
+	{
+		for (size_t j = 0; j < n; j++)
+			sizes[j] = leaf_size(record_key_size(&records[j]) - prefix,
+					records[j].value_size);
+		split = split_point(transaction, path, level, index, sizes, n,
+				prefix_stored(prefix), 0);
+	}
+	else
+		split = index == 0 ? 1 : n - 1;
+
+	/* the prefix of the leaf suits either side the key is not on */
+	int r = -1;
+	leaf_build(transaction, page, records, split, shares || index >= split ? prefix : 0,
+			page_usable(transaction));
+	leaf_build(transaction, right, records + split, n - split,
+			shares || index < split ? prefix : 0, page_usable(transaction));
+	size_t separator_size = record_key_size(&records[split]);
+	if ((separator = malloc(separator_size + 1)) != NULL)
+	{
+		record_copy(&records[split], 0, separator_size, separator);
+		r = split_link(transaction, path, level, separator, separator_size, right_number);
+	}
+	free(separator);
+	free(records);
+	free(copy);
+	free(sizes);
+	return r;
+}
+
+/*
+ * Restore the balance of the tree after an entry was removed from the page at
+ * @level of @path: underfull pages are merged with a sibling when both fit in
+ * one page, and a root branch with a single child is collapsed.
+ */
+static int btree_rebalance(transaction_t *transaction, path_t *path, size_t level)
+{
+	size_t number = path->page[level];
+	page_t *page = page_get(transaction, number);
+
+	if (level == 0)
+	{
+		while ((page->flags & PAGE_BRANCH) && page->count == 1)
+		{
+			transaction->root = branch_at(page, 0)->child;
+			if (page_free(transaction, number) == -1)
+				return -1;
+			number = transaction->root;
+			page = page_get(transaction, number);
+		}
+		if ((page->flags & PAGE_BRANCH) && page->count == 0)
+			page_init(transaction, page, PAGE_LEAF);
+		return 0;
+	}
+
+	if (page_used(transaction, page) >= page_usable(transaction) / 4
+			&& page->count > 1)
+		return 0;
+
+	page_t *parent = page_get(transaction, path->page[level - 1]);
+	size_t index = path->index[level - 1];
+
+	if (page->count == 0)
+	{
+		/* drop an empty page altogether */
+		page_remove(parent, index);
+		if (page_free(transaction, number) == -1)
+			return -1;
+		return btree_rebalance(transaction, path, level - 1);
+	}
+
+	size_t left_index;
+	if (index > 0)
+		left_index = index - 1;
+	else if (index + 1 < parent->count)
+		left_index = index;
+	else
+		return 0;
+
+	/*
+	 * A branch merge pulls the separator down as the key of the right slot 0;
+	 * a leaf merge lays the two leaves out as one, with the prefix they share.
+	 */
+	page_t *left = page_get(transaction, branch_at(parent, left_index)->child);
+	page_t *right = page_get(transaction, branch_at(parent, left_index + 1)->child);
+	size_t used = page_used(transaction, left) + page_used(transaction, right);
+	if (right->flags & PAGE_BRANCH)
+		used = used - entry_size(right, 0)
+				+ branch_size(branch_at(parent, left_index + 1)->key_size);
+	else
+	{
+		record_t *records;
+		if ((records = malloc((left->count + right->count) * sizeof(record_t))) == NULL)
+			return -1;
+		size_t prefix;
+		leaf_pair(left, right, records);
+		used = leaf_choose(records, left->count + right->count, 0, &prefix);
+		free(records);
+	}
+	if (used > page_usable(transaction))
+		return 0;
+
+	/* the page itself is on the touched path; a left sibling is not */
+	if (left_index != index)
+	{
+		size_t sibling = branch_at(parent, left_index)->child;
+		if (page_writable(transaction, &sibling) == -1)
+			return -1;
+		parent = page_get(transaction, path->page[level - 1]);
+		branch_at(parent, left_index)->child = sibling;
+	}
+
+	size_t right_number = branch_at(parent, left_index + 1)->child;
+	left = page_get(transaction, branch_at(parent, left_index)->child);
+	right = page_get(transaction, right_number);
+	branch_t *separator = branch_at(parent, left_index + 1);
+
+	if (right->flags & PAGE_LEAF)
+	{
+		char *copy = malloc(PAGE_SIZE(transaction->database));
+		record_t *records = malloc((left->count + right->count) * sizeof(record_t));
+		if (copy == NULL || records == NULL)
+		{
+			free(copy);
+			free(records);
+			return -1;
+		}
+		memcpy(copy, left, PAGE_SIZE(transaction->database));
+		leaf_pair((page_t *) copy, right, records);
+		leaf_build(transaction, left, records, left->count + right->count, 0,
+				page_usable(transaction));
+		free(records);
+		free(copy);
+	}
+	for (size_t j = 0; j < right->count && (right->flags & PAGE_BRANCH); j++)
+	{
+		size_t size = entry_size(right, j);
+		if (j == 0)
+		{
+			branch_insert(left, left->count, separator->data, separator->key_size,
+					branch_at(right, 0)->child);
+			continue;
+		}
+		page_insert(left, left->count, page_entry(right, j), size);
+	}
+
+	page_remove(parent, left_index + 1);
+	if (page_free(transaction, right_number) == -1)
+		return -1;
+	return btree_rebalance(transaction, path, level - 1);
+}
+
+size_t btree_new(transaction_t *transaction)
+{
+	size_t root;
+	if ((root = page_allocate(transaction)) == P_INVALID)
+		return P_INVALID;
+	page_init(transaction, page_get(transaction, root), PAGE_LEAF);
+	return root;
+}
+
+int btree_free(transaction_t *transaction, size_t root)
+{
+	page_t *page = page_get(transaction, root);
+	for (size_t i = 0; i < page->count; i++)
+	{
+		if (page->flags & PAGE_BRANCH)
+		{
+			if (btree_free(transaction, branch_at(page, i)->child) == -1)
+				return -1;
+			page = page_get(transaction, root);
+		}
+		else if (overflow_free(transaction, leaf_at(page, i)) == -1)
+			return -1;
+	}
+	return page_free(transaction, root);
+}
+
+int btree_pages(transaction_t *transaction, size_t root, size_t since,
+		page_list_t *pages)
+{
+	size_t i = pages->length;
+	if (page_get(transaction, root)->txnid <= since)
+		return 0;
+	if (page_list_push(pages, root) == -1)
+		return -1;
+	for (; i < pages->length; i++)
+	{
+		page_t *page = page_get(transaction, pages->pages[i]);
+		if (page->flags & PAGE_OVERFLOW)
+		{
+			/* the rest of the run follows, with no header to look at */
+			i += page_span(page) - 1;
+			continue;
+		}
+		for (size_t j = 0; j < page->count; j++)
+		{
+			size_t child, span = 1;
+			if (page->flags & PAGE_BRANCH)
+				child = branch_at(page, j)->child;
+			else if (leaf_at(page, j)->value_size & LEAF_OVERFLOW)
+			{
+				child = leaf_overflow(leaf_at(page, j));
+				span = page_span(page_get(transaction, child));
+			}
+			else
+				continue;
+			if (page_get(transaction, child)->txnid <= since)
+				continue;
+			for (size_t k = 0; k < span; k++)
+			{
+				if (page_list_push(pages, child + k) == -1)
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int btree_links(page_t *page)
+{
+	if (page->flags & PAGE_BRANCH)
+		return 1;
+	if (page->flags & PAGE_OVERFLOW)
+		return 0;
+	for (size_t i = 0; i < page->count; i++)
+	{
+		if (leaf_at(page, i)->value_size & LEAF_OVERFLOW)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Move the overflow run of entry @i of the leaf *@number, @depth levels down,
+ * to a run of as many reclaimed pages below @limit, if it is above it and
+ * there is one. Copying the leaf and the branches above it takes one page for
+ * each level on top of the run; see relocate.
+ */
+static int relocate_overflow(transaction_t *transaction, size_t *number, size_t i,
+		size_t limit, size_t depth)
+{
+	leaf_t *leaf = leaf_at(page_get(transaction, *number), i);
+	if (!(leaf->value_size & LEAF_OVERFLOW))
+		return 0;
+	size_t from = leaf_overflow(leaf), to;
+	size_t count = page_span(page_get(transaction, from));
+	if (from < limit || transaction->reclaimed.length <= count + depth
+			|| (to = page_take_run(transaction, count, limit)) == P_INVALID)
+		return 0;
+	if (page_list_push(&transaction->dirty, to) == -1)
+		return -1;
+	memcpy(page_get(transaction, to), page_get(transaction, from),
+			count * PAGE_SIZE(transaction->database));
+	page_get(transaction, to)->flags |= PAGE_DIRTY;
+	if (page_free_run(transaction, from, count) == -1
+			|| page_writable(transaction, number) == -1)
+		return -1;
+
+	uint64_t moved = to;
+	leaf = leaf_at(page_get(transaction, *number), i);
+	memcpy(leaf->data + leaf->key_size, &moved, sizeof(moved));
+	return 0;
+}
+
+/*
+ * Move the pages of the subtree at *@number, @depth levels down, from @limit
+ * up. Copying a page takes at worst one more for each branch above it, and a
+ * page is only moved while the reclaimed ones cover that; then the copies
+ * never come from the end of the file.
+ */
+static int relocate(transaction_t *transaction, size_t *number, size_t limit,
+		size_t depth)
+{
+	page_t *page = page_get(transaction, *number);
+	if (page->flags & PAGE_LEAF)
+	{
+		for (size_t i = 0; i < page->count; i++)
+		{
+			if (relocate_overflow(transaction, number, i, limit, depth) == -1)
+				return -1;
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < page->count; i++)
+		{
+			size_t child = branch_at(page, i)->child;
+			if (relocate(transaction, &child, limit, depth + 1) == -1)
+				return -1;
+			if (child == branch_at(page, i)->child)
+				continue;
+			if (page_writable(transaction, number) == -1)
+				return -1;
+			page = page_get(transaction, *number);
+			branch_at(page, i)->child = child;
+		}
+	}
+	if (*number >= limit && transaction->reclaimed.length > depth)
+		return page_writable(transaction, number);
+	return 0;
+}
+
+int btree_relocate(transaction_t *transaction, size_t limit)
+{
+	if (transaction->root == P_INVALID)
+		return 0;
+	return relocate(transaction, &transaction->root, limit, 0);
+}
+
+void btree_renumber(transaction_t *transaction, page_t *page, size_t *next)
+{
+	for (size_t i = 0; i < page->count; i++)
+	{
+		if (page->flags & PAGE_BRANCH)
+			branch_at(page, i)->child = (*next)++;
+		else if (leaf_at(page, i)->value_size & LEAF_OVERFLOW)
+		{
+			leaf_t *leaf = leaf_at(page, i);
+			uint64_t number = *next;
+			*next += page_span(page_get(transaction, leaf_overflow(leaf)));
+			memcpy(leaf->data + leaf->key_size, &number, sizeof(number));
+		}
+	}
+}
+
+int btree_load_start(db_loader_t *loader, unsigned fill_percent)
+{
+	transaction_t *transaction = loader->transaction;
+	page_t *root = page_get(transaction, transaction->root);
+	if (fill_percent < 50 || fill_percent > 100
+			|| !(root->flags & PAGE_LEAF) || root->count > 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (page_writable(transaction, &transaction->root) == -1)
+		return -1;
+
+	loader->fill = page_usable(transaction) * fill_percent / 100;
+	loader->page[0] = transaction->root;
+	loader->depth = 1;
+	return 0;
+}
+
+/* start a page to fill at @level after the one there */
+static page_t *load_next(db_loader_t *loader, size_t level, uint16_t flags)
+{
+	size_t number;
+	if ((number = page_allocate(loader->transaction)) == P_INVALID)
+		return NULL;
+	page_t *page = page_get(loader->transaction, number);
+	page_init(loader->transaction, page, flags);
+	loader->page[level] = number;
+	return page;
+}
+
+/*
+ * Link @child, started after @left was filled, into the branch at @level,
+ * starting the level if @left was the first page of the one below. Branches
+ * are filled completely: with entries of at most half a page each, every
+ * branch but the last of its level ends up with two children at least. The
+ * last one may be left with a single child by btree_load_finish, which
+ * searches handle like any other branch and deletes merge away.
+ */
+static int load_link(db_loader_t *loader, size_t level, const void *key,
+		size_t key_size, size_t left, size_t child)
+{
+	transaction_t *transaction = loader->transaction;
+	size_t size = branch_size(key_size);
+	page_t *page;
+	if (level == loader->depth)
+	{
+		if ((page = load_next(loader, level, PAGE_BRANCH)) == NULL)
+			return -1;
+		branch_insert(page, 0, NULL, 0, left);
+		loader->depth += 1;
+	}
+
+	page = page_get(transaction, loader->page[level]);
+	if (page_fits(page, size))
+	{
+		branch_insert(page, page->count, key, key_size, child);
+		return 0;
+	}
+
+	/* the key moves up instead, as the lower bound of the next branch */
+	left = loader->page[level];
+	if ((page = load_next(loader, level, PAGE_BRANCH)) == NULL)
+		return -1;
+	branch_insert(page, 0, NULL, 0, child);
+	return load_link(loader, level + 1, key, key_size, left, loader->page[level]);
+}
+
+int btree_load_put(db_loader_t *loader, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	transaction_t *transaction = loader->transaction;
+	if (entry_too_big(transaction, key_size, value_size))
+		return -1;
+
+	page_t *page = page_get(transaction, loader->page[0]);
+	if (page->count > 0)
+	{
+		record_t last = leaf_record(page, page->count - 1);
+		if (record_compare(&last, key, key_size) >= 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	uint64_t number;
+	if (value_overflows(transaction, key_size, value_size))
+	{
+		if (overflow_new(transaction, value, value_size, &number) == -1)
+			return -1;
+		value = &number;
+		value_size |= LEAF_OVERFLOW;
+		page = page_get(transaction, loader->page[0]);
+	}
+
+	int r = leaf_add(transaction, page, page->count, key, key_size, value, value_size,
+			page->count == 0 ? page_usable(transaction) : loader->fill);
+	if (r != 1)
+		return r;
+
+	size_t left = loader->page[0];
+	if ((page = load_next(loader, 0, PAGE_LEAF)) == NULL
+			|| leaf_add(transaction, page, 0, key, key_size, value, value_size,
+					page_usable(transaction)) == -1)
+		return -1;
+	return load_link(loader, 1, key, key_size, left, loader->page[0]);
+}
+
+void btree_load_finish(db_loader_t *loader)
+{
+	loader->transaction->root = loader->page[loader->depth - 1];
+}
+
+int btree_get(transaction_t *transaction, const void *key, size_t key_size,
+		const void **value, size_t *value_size)
+{
+	page_t *page = page_get(transaction, transaction->root);
+	while (page->flags & PAGE_BRANCH)
+	{
+		size_t i = branch_search(page, key, key_size);
+		page = page_get(transaction, branch_at(page, i)->child);
+	}
+
+	int exact;
+	size_t i = page_search(page, key, key_size, &exact);
+	if (!exact)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	leaf_value(transaction, leaf_at(page, i), value, value_size);
+	return 0;
+}
+
+/* a key of btree_get_many and where its descent is */
+typedef struct probe_t
+{
+	const db_item_t *key;
+	size_t page; /* reached at the current level */
+	size_t slot; /* taken in that page */
+} probe_t;
+
+static int probe_compare(const void *a, const void *b)
+{
+	const db_item_t *x = ((const probe_t *) a)->key, *y = ((const probe_t *) b)->key;
+	return key_compare(x->data, x->size, y->data, y->size);
+}
+
+/*
+ * Search @probe in @page, knowing the previous probe, which is not greater,
+ * took slot @after there (SIZE_MAX if it was on another page): the search
+ * starts from that slot, where it most often ends.
+ */
+static size_t probe_search(page_t *page, const probe_t *probe, size_t after, int *exact)
+{
+	const db_item_t *key = probe->key;
+	if (page->flags & PAGE_BRANCH)
+	{
+		/* the slot of the child covering the key */
+		size_t i = page_search_from(page, after == SIZE_MAX ? 1 : after + 1,
+				key->data, key->size, exact);
+		return *exact ? i : i - 1;
+	}
+	return page_search_from(page, after == SIZE_MAX ? 0 : after, key->data, key->size,
+			exact);
+}
+
+/*
+ * The pages of the next level are all known before any of them is searched:
+ * they are prefetched together, into the CPU cache when they are in memory
+ * and from the disk otherwise, which the first of them tells.
+ */
+static void probe_prefetch(transaction_t *transaction, size_t *pages, size_t count)
+{
+	if (count == 0)
+		return;
+	if (!page_resident(transaction, pages[0]))
+	{
+		page_prefetch(transaction, pages, count);
+		return;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		page_t *page = page_get(transaction, pages[i]);
+		/* the header and the start of the slots, which the search reads first */
+		__builtin_prefetch(page);
+		__builtin_prefetch((char *) page + CACHE_LINE_SIZE);
+	}
+}
+
+int btree_get_many(transaction_t *transaction, const db_item_t *keys, size_t count,
+		db_item_t *values)
+{
+	probe_t *probes;
+	size_t *pages;
+	/* one more, as malloc(0) may fail */
+	if ((probes = malloc((count + 1) * sizeof(probe_t))) == NULL)
+		return -1;
+	if ((pages = malloc((count + 1) * sizeof(size_t))) == NULL)
+	{
+		free(probes);
+		return -1;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		probes[i].key = &keys[i];
+		probes[i].page = transaction->root;
+	}
+	qsort(probes, count, sizeof(probe_t), probe_compare);
+
+	/* every leaf is as deep as the others: the probes go down a level at a time */
+	page_t *page = page_get(transaction, transaction->root);
+	while (count > 0 && (page->flags & PAGE_BRANCH))
+	{
+		size_t distinct = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			probe_t *probe = &probes[i];
+			int same = i > 0 && probe->page == probes[i - 1].page;
+			int exact;
+			page = page_get(transaction, probe->page);
+			probe->slot = probe_search(page, probe, same ? probes[i - 1].slot : SIZE_MAX,
+					&exact);
+			probe->page = branch_at(page, probe->slot)->child;
+			if (distinct == 0 || pages[distinct - 1] != probe->page)
+				pages[distinct++] = probe->page;
+		}
+		probe_prefetch(transaction, pages, distinct);
+		page = page_get(transaction, probes[0].page);
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		probe_t *probe = &probes[i];
+		int same = i > 0 && probe->page == probes[i - 1].page;
+		int exact;
+		page = page_get(transaction, probe->page);
+		probe->slot = probe_search(page, probe, same ? probes[i - 1].slot : SIZE_MAX,
+				&exact);
+		db_item_t *value = &values[probe->key - keys];
+		if (exact)
+			leaf_value(transaction, leaf_at(page, probe->slot), &value->data, &value->size);
+		else
+		{
+			value->data = NULL;
+			value->size = 0;
+		}
+	}
+
+	free(pages);
+	free(probes);
+	return 0;
+}
+
+int btree_put(transaction_t *transaction, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	if (entry_too_big(transaction, key_size, value_size))
+		return -1;
+
+	path_t path;
+	if (path_find(transaction, key, key_size, &path) == -1)
+		return -1;
+
+	size_t level = path.depth - 1;
+	int exact;
+	size_t i = page_search(page_get(transaction, path.page[level]), key, key_size,
+			&exact);
+	if (exact)
+	{
+		const void *old;
+		size_t old_size;
+		leaf_value(transaction, leaf_at(page_get(transaction, path.page[level]), i), &old,
+				&old_size);
+		if (old_size == value_size && (value_size == 0
+				|| memcmp(old, value, value_size) == 0))
+			return 0;
+	}
+
+	if (path_writable(transaction, &path) == -1)
+		return -1;
+	uint64_t number;
+	if (value_overflows(transaction, key_size, value_size))
+	{
+		if (overflow_new(transaction, value, value_size, &number) == -1)
+			return -1;
+		value = &number;
+		value_size |= LEAF_OVERFLOW;
+	}
+	page_t *page = page_get(transaction, path.page[level]);
+	if (exact)
+	{
+		/* the key stays as it is */
+		leaf_t *leaf = leaf_at(page, i);
+		if (overflow_free(transaction, leaf) == -1)
+			return -1;
+		if (leaf_size(leaf->key_size, leaf->value_size)
+				== leaf_size(leaf->key_size, value_size))
+		{
+			leaf->value_size = value_size;
+			if (value_stored(value_size) > 0)
+				memcpy(leaf->data + leaf->key_size, value, value_stored(value_size));
+			return 0;
+		}
+		page_remove(page, i);
+	}
+
+	int r = leaf_add(transaction, page, i, key, key_size, value, value_size,
+			page_usable(transaction));
+	if (r != 1)
+		return r;
+	return leaf_split(transaction, &path, level, i, key, key_size, value, value_size);
+}
+
+int btree_del(transaction_t *transaction, const void *key, size_t key_size)
+{
+	path_t path;
+	if (path_find(transaction, key, key_size, &path) == -1)
+		return -1;
+
+	size_t level = path.depth - 1;
+	int exact;
+	size_t i = page_search(page_get(transaction, path.page[level]), key, key_size,
+			&exact);
+	if (!exact)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	if (path_writable(transaction, &path) == -1)
+		return -1;
+	page_t *page = page_get(transaction, path.page[level]);
+	if (overflow_free(transaction, leaf_at(page, i)) == -1)
+		return -1;
+	page_remove(page, i);
+	return btree_rebalance(transaction, &path, level);
+}
+
+/* moves to another leaf in a row after which the next leaves are prefetched */
+#define CURSOR_SEQUENTIAL 2
+/* leaves prefetched ahead of a cursor at most */
+#define CURSOR_READAHEAD_MAX 64
+
+/*
+ * Move the cursor down from the page at its deepest level to the first leaf,
+ * or the last one if @last, under it.
+ */
+static int cursor_descend(db_cursor_t *cursor, int last)
+{
+	path_t *path = &cursor->path;
+	transaction_t *transaction = cursor->transaction;
+	page_t *page = page_get(transaction, path->page[path->depth - 1]);
+	while (page->flags & PAGE_BRANCH)
+	{
+		if (path->depth == BTREE_MAX_DEPTH)
+		{
+			errno = EOVERFLOW;
+			return -1;
+		}
+		size_t child = branch_at(page, path->index[path->depth - 1])->child;
+		page = page_get(transaction, child);
+		path->page[path->depth] = child;
+		path->index[path->depth] = last ? page->count - 1 : 0;
+		path->depth += 1;
+	}
+	return 0;
+}
+
+/*
+ * The cursor just moved to another leaf in @direction. Once it has done so a
+ * few times in a row, prefetch the leaves after it under the same branch,
+ * keeping half a window ahead of the cursor; the window doubles with every
+ * move, up to CURSOR_READAHEAD_MAX.
+ */
+static void cursor_readahead(db_cursor_t *cursor, int direction)
+{
+	path_t *path = &cursor->path;
+	if (cursor->direction != direction)
+	{
+		cursor->direction = direction;
+		cursor->streak = 0;
+		cursor->hinted = 0;
+	}
+	cursor->streak++;
+	if (cursor->hinted > 0)
+		cursor->hinted--;
+	if (cursor->streak < CURSOR_SEQUENTIAL || path->depth < 2)
+		return;
+
+	size_t window = CURSOR_READAHEAD_MAX;
+	if (cursor->streak - CURSOR_SEQUENTIAL < 6)
+		window = (size_t) 2 << (cursor->streak - CURSOR_SEQUENTIAL);
+	if (window > CURSOR_READAHEAD_MAX)
+		window = CURSOR_READAHEAD_MAX;
+	if (cursor->hinted > window / 2)
+		return;
+
+	page_t *parent = page_get(cursor->transaction, path->page[path->depth - 2]);
+	size_t index = path->index[path->depth - 2];
+	/* the children not hinted yet, in [from, to) */
+	size_t from, to;
+	if (direction > 0)
+	{
+		from = index + 1 + cursor->hinted;
+		to = from + (window - cursor->hinted);
+		if (to > parent->count)
+			to = parent->count;
+	}
+	else
+	{
+		to = index > cursor->hinted ? index - cursor->hinted : 0;
+		from = to > window - cursor->hinted ? to - (window - cursor->hinted) : 0;
+	}
+	if (from >= to)
+		return;
+
+	size_t numbers[CURSOR_READAHEAD_MAX];
+	for (size_t i = from; i < to; i++)
+		numbers[i - from] = branch_at(parent, i)->child;
+	page_prefetch(cursor->transaction, numbers, to - from);
+	cursor->hinted += to - from;
+}
+
+/* move the cursor past the end of its leaf on to the first entry of the next */
+static int cursor_next_leaf(db_cursor_t *cursor)
+{
+	path_t *path = &cursor->path;
+	do
+	{
+		if (--path->depth == 0)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+		path->index[path->depth - 1] += 1;
+	} while (path->index[path->depth - 1]
+			>= page_get(cursor->transaction, path->page[path->depth - 1])->count);
+	if (cursor_descend(cursor, 0) == -1)
+		return -1;
+	cursor_readahead(cursor, 1);
+	return 0;
+}
+
+/* move the cursor before the start of its leaf on to the last entry of the previous */
+static int cursor_prev_leaf(db_cursor_t *cursor)
+{
+	path_t *path = &cursor->path;
+	do
+	{
+		if (--path->depth == 0)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+	} while (path->index[path->depth - 1] == 0);
+	path->index[path->depth - 1] -= 1;
+	if (cursor_descend(cursor, 1) == -1)
+		return -1;
+	cursor_readahead(cursor, -1);
+	return 0;
+}
+
+/* position the cursor on the first entry, or the last one if @last */
+static int cursor_end(db_cursor_t *cursor, int last)
+{
+	path_t *path = &cursor->path;
+	page_t *root = page_get(cursor->transaction, cursor->transaction->root);
+	cursor->direction = 0;
+	path->depth = 0;
+	if (root->count == 0)
+	{
+		/* only the root can be an empty leaf */
+		errno = ENOENT;
+		return -1;
+	}
+	path->page[0] = cursor->transaction->root;
+	path->index[0] = last ? root->count - 1 : 0;
+	path->depth = 1;
+	return cursor_descend(cursor, last);
+}
+
+int btree_cursor_first(db_cursor_t *cursor)
+{
+	return cursor_end(cursor, 0);
+}
+
+int btree_cursor_last(db_cursor_t *cursor)
+{
+	return cursor_end(cursor, 1);
+}
+
+int btree_cursor_seek(db_cursor_t *cursor, const void *key, size_t key_size)
+{
+	path_t *path = &cursor->path;
+	size_t number = cursor->transaction->root;
+	cursor->direction = 0;
+	path->depth = 0;
+	for (;;)
+	{
+		page_t *page = page_get(cursor->transaction, number);
+		if (path->depth == BTREE_MAX_DEPTH)
+		{
+			errno = EOVERFLOW;
+			return -1;
+		}
+		path->page[path->depth] = number;
+		if (page->flags & PAGE_LEAF)
+		{
+			int exact;
+			path->index[path->depth++] = page_search(page, key, key_size, &exact);
+			if (path->index[path->depth - 1] < page->count)
+				return 0;
+			return cursor_next_leaf(cursor);
+		}
+		size_t i = branch_search(page, key, key_size);
+		path->index[path->depth++] = i;
+		number = branch_at(page, i)->child;
+	}
+}
+
+int btree_cursor_seek_last(db_cursor_t *cursor, const void *key, size_t key_size)
+{
+	if (btree_cursor_seek(cursor, key, key_size) == -1)
+		return errno == ENOENT ? btree_cursor_last(cursor) : -1;
+	const void *found;
+	size_t found_size;
+	if (btree_cursor_get(cursor, &found, &found_size, NULL, NULL) == -1)
+		return -1;
+	if (key_compare(found, found_size, key, key_size) == 0)
+		return 0;
+	return btree_cursor_prev(cursor);
+}
+
+int btree_cursor_next(db_cursor_t *cursor)
+{
+	path_t *path = &cursor->path;
+	if (path->depth == 0)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	page_t *leaf = page_get(cursor->transaction, path->page[path->depth - 1]);
+	if (++path->index[path->depth - 1] < leaf->count)
+		return 0;
+	return cursor_next_leaf(cursor);
+}
+
+int btree_cursor_prev(db_cursor_t *cursor)
+{
+	path_t *path = &cursor->path;
+	if (path->depth == 0)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	if (path->index[path->depth - 1]-- > 0)
+		return 0;
+	return cursor_prev_leaf(cursor);
+}
+
+int btree_cursor_get(db_cursor_t *cursor, const void **key, size_t *key_size,
+		const void **value, size_t *value_size)
+{
+	path_t *path = &cursor->path;
+	if (path->depth == 0)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	page_t *page = page_get(cursor->transaction, path->page[path->depth - 1]);
+	leaf_t *leaf = leaf_at(page, path->index[path->depth - 1]);
+	if (key != NULL && page->prefix == 0)
+	{
+		*key = leaf->data;
+		*key_size = leaf->key_size;
+	}
+	else if (key != NULL)
+	{
+		/* the key is put back together behind its prefix */
+		if (cursor->key == NULL
+				&& (cursor->key = malloc(PAGE_SIZE(cursor->transaction->database))) == NULL)
+			return -1;
+		memcpy(cursor->key, page->data, page->prefix);
+		memcpy(cursor->key + page->prefix, leaf->data, leaf->key_size);
+		*key = cursor->key;
+		*key_size = page->prefix + leaf->key_size;
+	}
+	if (value != NULL)
+		leaf_value(cursor->transaction, leaf, value, value_size);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stddef.h>
+
+#include "database.h"
+#include "page.h"
+
+/*
+ * Copy-on-write B+tree over the pages of a database file.
+ *
+ * A transaction sees the tree rooted at transaction->root. Modifications copy
+ * the pages on the root-to-leaf path they touch (unless the transaction already
+ * owns them) so the tree of every published version is left intact; the new
+ * root is published by the commit.
+ *
+ * Functions return 0 on success and -1 with errno set on failure. A missing key
+ * is reported with ENOENT.
+ */
+
+/* enough for 2^64 entries even if every branch only had two children */
+#define BTREE_MAX_DEPTH 64
+
+/* the pages (and the slot taken in each of them) from the root to a leaf */
+typedef struct path_t
+{
+	size_t page[BTREE_MAX_DEPTH];
+	size_t index[BTREE_MAX_DEPTH];
+	size_t depth;
+} path_t;
+
+struct db_cursor_t
+{
+	transaction_t *transaction;
+	path_t path; /* empty when the cursor is not on an entry */
+	/* readahead: the moves to another leaf made in a row in one direction */
+	int direction; /* 1 forward, -1 backward, 0 before the first */
+	size_t streak;
+	size_t hinted; /* leaves beyond the current one already prefetched */
+	char *key;     /* the last key returned, if it had to be put together */
+};
+
+/* a bulk load in progress: the last page of each level, leaves first */
+struct db_loader_t
+{
+	transaction_t *transaction;
+	size_t fill;  /* bytes of a leaf filled before the next one is started */
+	size_t page[BTREE_MAX_DEPTH];
+	size_t depth; /* levels started */
+};
+
+/* create an empty tree and return its root page (P_INVALID on failure) */
+size_t btree_new(transaction_t *transaction);
+
+/* release every page of the tree rooted at @root */
+int btree_free(transaction_t *transaction, size_t root);
+
+/*
+ * Append the pages of the tree rooted at @root written after commit @since to
+ * @pages breadth first, the children of each branch in key order and the
+ * overflow runs of each leaf, every page of them, in the order of their
+ * entries. Subtrees written before are not looked into.
+ */
+int btree_pages(transaction_t *transaction, size_t root, size_t since,
+		page_list_t *pages);
+/* whether @page points at other pages: a branch, or a leaf with overflow runs */
+int btree_links(page_t *page);
+/*
+ * Point the children of the branch @page, or the overflow runs of the leaf
+ * @page, at consecutive pages from *@next on, which is how btree_pages lists
+ * them when the tree is laid out in its order.
+ */
+void btree_renumber(transaction_t *transaction, page_t *page, size_t *next);
+
+/*
+ * Copy the pages of the tree numbered @limit or above to pages reclaimed ahead
+ * of time (see page_reclaim), along with the branches on the way to them, to
+ * pack the tree at the start of the file. Pages are only moved as long as the
+ * reclaimed pages last.
+ */
+int btree_relocate(transaction_t *transaction, size_t limit);
+
+/*
+ * Build the tree of @loader->transaction, which must be empty, from entries
+ * given in increasing key order (EINVAL otherwise). Leaves are filled to
+ * @fill_percent (from 50 to 100) of a page and branches are built bottom-up as
+ * they fill; btree_load_finish sets the root.
+ */
+int btree_load_start(db_loader_t *loader, unsigned fill_percent);
+int btree_load_put(db_loader_t *loader, const void *key, size_t key_size,
+		const void *value, size_t value_size);
+void btree_load_finish(db_loader_t *loader);
+
+int btree_get(transaction_t *transaction, const void *key, size_t key_size,
+		const void **value, size_t *value_size);
+/*
+ * Look the @count @keys up at once, setting the data of the values of the
+ * missing ones to NULL. The keys are sorted and go down the tree together, a
+ * level at a time: a page is searched for every key that reaches it in turn,
+ * and the pages of the next level are prefetched before they are searched.
+ */
+int btree_get_many(transaction_t *transaction, const db_item_t *keys, size_t count,
+		db_item_t *values);
+int btree_put(transaction_t *transaction, const void *key, size_t key_size,
+		const void *value, size_t value_size);
+int btree_del(transaction_t *transaction, const void *key, size_t key_size);
+
+/*
+ * Cursors walk the entries of the tree in key order, either way. A cursor that
+ * runs off either end of the tree fails with ENOENT. Once a cursor has moved
+ * to a few leaves in a row, the next leaves under the same branch are
+ * prefetched, more of them the longer the scan goes on.
+ */
+int btree_cursor_first(db_cursor_t *cursor);
+int btree_cursor_last(db_cursor_t *cursor);
+int btree_cursor_seek(db_cursor_t *cursor, const void *key, size_t key_size);
+int btree_cursor_seek_last(db_cursor_t *cursor, const void *key, size_t key_size);
+int btree_cursor_next(db_cursor_t *cursor);
+int btree_cursor_prev(db_cursor_t *cursor);
+int btree_cursor_get(db_cursor_t *cursor, const void **key, size_t *key_size,
+		const void **value, size_t *value_size);
+
+#endif /* BTREE_H */
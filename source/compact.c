@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btree.h"
+#include "database.h"
+#include "lock.h"
+#include "page.h"
+
+/* passes after which compaction stops even if it still makes progress */
+#define COMPACT_PASSES_MAX 16
+
+static int number_compare(const void *a, const void *b)
+{
+	size_t x = *(const size_t *) a, y = *(const size_t *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * The page number below which the tree fits once packed: the pages of the
+ * tree (@tree, in increasing order) and the reclaimed ones (highest first)
+ * below it are as many as the tree has pages, so every page of the tree above
+ * it has a reclaimed page below it to go to.
+ */
+static size_t compact_limit(const page_list_t *tree, const page_list_t *reclaimed)
+{
+	size_t i = 0, j = reclaimed->length;
+	for (size_t k = 0; k < tree->length; k++)
+	{
+		if (j > 0 && (i == tree->length || reclaimed->pages[j - 1] < tree->pages[i]))
+			j--;
+		else
+			i++;
+	}
+
+	size_t limit = P_INVALID;
+	if (i < tree->length)
+		limit = tree->pages[i];
+	if (j > 0 && reclaimed->pages[j - 1] < limit)
+		limit = reclaimed->pages[j - 1];
+	return limit;
+}
+
+/*
+ * Give the space of the reclaimed pages left unused back to the file system.
+ * Nobody reads them and they go back on the freelist, so what they hold does
+ * not matter; a file system that cannot punch holes only keeps the space.
+ */
+static void compact_punch(transaction_t *transaction)
+{
+	database_t *database = transaction->database;
+	const page_list_t *reclaimed = &transaction->reclaimed;
+	for (size_t i = 0, run; i < reclaimed->length; i += run)
+	{
+		run = 1;
+		while (i + run < reclaimed->length
+				&& reclaimed->pages[i + run] == reclaimed->pages[i] - run)
+			run++;
+		fallocate(database->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(reclaimed->pages[i + run - 1]) * PAGE_SIZE(database),
+				run * PAGE_SIZE(database));
+	}
+}
+
+/*
+ * One write transaction: drop the free pages at the end of the file, move the
+ * pages of the tree beyond the packing limit to the free pages below it and
+ * punch out the free pages left. Return 1 if pages were moved or dropped, 0 if
+ * not and -1 on failure.
+ */
+static int compact_pass(database_t *database)
+{
+	transaction_t *transaction;
+	if ((transaction = start_transaction(database, TRANSACTION_MODE_RW)) == NULL)
+		return -1;
+	size_t root = transaction->root;
+	size_t num_pages = transaction->num_pages;
+	page_list_t *reclaimed = &transaction->reclaimed;
+	page_list_t tree = { 0 };
+	int r = -1;
+
+	if (page_reclaim(transaction) == 0)
+	{
+		size_t dropped = 0;
+		while (dropped < reclaimed->length
+				&& reclaimed->pages[dropped] == transaction->num_pages - 1)
+		{
+			dropped++;
+			transaction->num_pages--;
+		}
+		if (dropped > 0)
+		{
+			memmove(reclaimed->pages, reclaimed->pages + dropped,
+					(reclaimed->length - dropped) * sizeof(size_t));
+			reclaimed->length -= dropped;
+		}
+
+		if (root == P_INVALID || btree_pages(transaction, root, 0, &tree) == 0)
+		{
+			qsort(tree.pages, tree.length, sizeof(size_t), number_compare);
+			if (btree_relocate(transaction, compact_limit(&tree, reclaimed)) == 0)
+			{
+				compact_punch(transaction);
+				r = transaction->root != root || transaction->num_pages != num_pages;
+			}
+		}
+	}
+
+	int error = errno;
+	page_list_clear(&tree);
+	if (r == -1)
+	{
+		cancel_transaction(database, transaction);
+		errno = error;
+		return -1;
+	}
+	/* even an idle pass commits; see database_compact */
+	transaction->publish = 1;
+	if (commit_transaction(database, transaction) == -1)
+		return -1;
+	return r;
+}
+
+/*
+ * Pages moved by a pass can only be reused, and dropped if they are at the
+ * end, once no reader and no meta page is left on the version before it. The
+ * older meta page moves on with the next commit, so compaction stops after two
+ * passes in a row made no progress: by then only readers hold pages back.
+ */
+int database_compact(database_t *database)
+{
+	int idle = 0;
+	for (int pass = 0; pass < COMPACT_PASSES_MAX && idle < 2; pass++)
+	{
+		int r;
+		if ((r = compact_pass(database)) == -1)
+			return -1;
+		idle = r ? 0 : idle + 1;
+	}
+
+	/* the file keeps no room ahead beyond its last page */
+	if (lock_writer(database) == -1)
+		return -1;
+	size_t size = database->file->num_pages * PAGE_SIZE(database);
+	int r = 0;
+	if (database->lock->file_size > size && (r = ftruncate(database->fd, size)) == 0)
+		database->lock->file_size = size;
+	unlock_writer(database);
+	return r;
+}
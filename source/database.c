@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -7,190 +9,539 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "btree.h"
 #include "database.h"
+#include "lock.h"
+#include "page.h"
+#include "stats.h"
 
-#define PAGE_SIZE (getpagesize())
-#define NUM_VERSIONS_INIT 100
 
+#define TRANSACTION_CACHE_SIZE 8
 
-// TODO: thread-safety -- make some stuff single-threaded; also, add atomics and
-// mutexes to stuff that is potentially multi-threaded
-// TODO: make refcount array a vector
-// TODO: only ftruncate periodically and synchronize refcount array
-// TODO: mmap less (it is slow). how could I avoid mmapping for a read
-// transaction?
+/*
+ * transaction handles a thread ended and can start again without malloc, and
+ * the reader slot it pins versions in
+ */
+typedef struct transaction_cache_t
+{
+	database_t *database;
+	transaction_t *handles[TRANSACTION_CACHE_SIZE];
+	size_t count;
+	reader_slot_t *slot;
+	uint64_t keeper; /* of the slot, see reader_keep */
+	struct transaction_cache_t *next; /* in database->caches */
+	struct transaction_cache_t **prev;
+} transaction_cache_t;
+
+static void transaction_cache_free(transaction_cache_t *cache)
+{
+	for (size_t i = 0; i < cache->count; i++)
+		free(cache->handles[i]);
+	/* unless another thread took the slot back */
+	if (cache->slot != NULL && reader_resume(cache->slot, cache->keeper) != -1)
+		reader_unclaim(cache->slot);
+	free(cache);
+}
+
+/* called when a thread that used the database exits */
+static void transaction_cache_destroy(void *value)
+{
+	transaction_cache_t *cache = value;
+	pthread_mutex_lock(&cache->database->cache_lock);
+	if (cache->next != NULL)
+		cache->next->prev = cache->prev;
+	*cache->prev = cache->next;
+	pthread_mutex_unlock(&cache->database->cache_lock);
+	transaction_cache_free(cache);
+}
+
+static transaction_cache_t *transaction_cache_get(database_t *database)
+{
+	transaction_cache_t *cache;
+	if ((cache = pthread_getspecific(database->cache_key)) != NULL)
+		return cache;
+
+	static uint64_t caches;
+	if ((cache = calloc(1, sizeof(transaction_cache_t))) == NULL)
+		return NULL;
+	cache->database = database;
+	/* unique to the thread among every process, with READER_IDLE clear */
+	cache->keeper = (uint64_t) getpid() << 32
+			| __atomic_add_fetch(&caches, 1, __ATOMIC_RELAXED) << 1;
+	if (pthread_setspecific(database->cache_key, cache) != 0)
+	{
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_lock(&database->cache_lock);
+	cache->next = database->caches;
+	cache->prev = &database->caches;
+	if (cache->next != NULL)
+		cache->next->prev = &cache->next;
+	database->caches = cache;
+	pthread_mutex_unlock(&database->cache_lock);
+	return cache;
+}
+
+static transaction_t *transaction_new(database_t *database, TRANSACTION_MODE tm,
+		transaction_t *storage)
+{
+	transaction_t *transaction = storage;
+	if (transaction == NULL)
+	{
+		transaction_cache_t *cache = pthread_getspecific(database->cache_key);
+		if (cache != NULL && cache->count > 0)
+			transaction = cache->handles[--cache->count];
+		else if ((transaction = malloc(sizeof(transaction_t))) == NULL)
+			return NULL;
+	}
+	memset(transaction, 0, sizeof(transaction_t));
+	transaction->database = database;
+	transaction->tm = tm;
+	transaction->caller_storage = storage != NULL;
+	return transaction;
+}
+
+/* start a write transaction from the header; the write lock must be held */
+static void transaction_begin_write(database_t *database, transaction_t *transaction)
+{
+	transaction->read_page = database->file->active_page;
+	transaction->root = transaction->read_page;
+	transaction->txnid = database->file->txnid;
+	transaction->num_pages = database->file->num_pages;
+	transaction->free_head = database->file->free_head;
+	transaction->free_used = database->file->free_used;
+	transaction->free_tail = database->file->free_tail;
+}
+
+static void transaction_free(transaction_t *transaction)
+{
+	page_list_clear(&transaction->dirty);
+	page_list_clear(&transaction->freed);
+	page_list_clear(&transaction->loose);
+	page_list_clear(&transaction->reclaimed);
+	if (transaction->caller_storage)
+		return;
 
-// TODO: check at database creation time if (PAGE_SIZE < sizeof(database_file_t))
-// TODO: if going more than 1page, use binary tree
+	transaction_cache_t *cache = transaction_cache_get(transaction->database);
+	if (cache != NULL && cache->count < TRANSACTION_CACHE_SIZE)
+		cache->handles[cache->count++] = transaction;
+	else
+		free(transaction);
+}
 
-struct database_file_t
+/* write @header to the data file; the flush lock keeps meta pages consistent */
+static int header_store(database_t *database, const database_file_t *header)
 {
-	size_t active_page;
-};
+	if (lock_mutex(&database->lock->flush_lock) == -1)
+		return -1;
+	meta_store(database, header);
+	unlock_mutex(&database->lock->flush_lock);
+	return 0;
+}
 
-static off_t get_page_offset(size_t number)
+/*
+ * Publish the tree built by a write transaction as the active version. The
+ * transaction works on its own copy of the header, so a failed or cancelled
+ * one leaves the database as it was.
+ *
+ * The header goes to the data file after the pages of the commit are on disk,
+ * except with group commit, where that is left to group_flush and @commit is
+ * set to the number of the commit to wait for.
+ */
+static int transaction_publish(database_t *database, transaction_t *transaction,
+		uint64_t *commit)
 {
-	return number * PAGE_SIZE;
+	if (page_retire(transaction) == -1)
+		return -1;
+
+	/* freelist pages have a layout of their own and are not stamped */
+	for (size_t i = 0; i < transaction->dirty.length; i++)
+	{
+		page_t *page = page_get(transaction, transaction->dirty.pages[i]);
+		page->flags &= ~PAGE_DIRTY;
+		if (!(page->flags & PAGE_FREELIST))
+			page->txnid = transaction->txnid + 1;
+	}
+
+	if (database->options.sync == SYNC_MODE_COMMIT && fdatasync(database->fd) == -1)
+		return -1;
+
+	database->file->num_pages = transaction->num_pages;
+	database->file->free_head = transaction->free_head;
+	database->file->free_used = transaction->free_used;
+	database->file->free_tail = transaction->free_tail;
+	/* readers pick the new version up from here, root first (see reader_pin) */
+	__atomic_store_n(&database->file->active_page, transaction->root, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&database->file->txnid, transaction->txnid + 1, __ATOMIC_SEQ_CST);
+
+	lock_file_t *lock = database->lock;
+	switch (database->options.sync)
+	{
+		case SYNC_MODE_NONE:
+			return header_store(database, database->file);
+		case SYNC_MODE_ASYNC:
+			if (header_store(database, database->file) == -1)
+				return -1;
+			return sync_file_range(database->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		case SYNC_MODE_COMMIT:
+			if (header_store(database, database->file) == -1)
+				return -1;
+			return fdatasync(database->fd);
+		case SYNC_MODE_GROUP:
+			if (lock_mutex(&lock->commit_lock) == -1)
+				return -1;
+			lock->committed = *database->file;
+			*commit = ++lock->commits;
+			unlock_mutex(&lock->commit_lock);
+			return 0;
+		default:
+			exit(1);
+	}
 }
 
-static size_t get_page_number(off_t offset)
+/*
+ * Group commit: committers wait in turn on the flush lock after releasing the
+ * writer lock, and the first one whose commit is not durable yet flushes every
+ * commit made so far. The others then find theirs done. A committer whose
+ * commit is still not durable afterwards, as a flush failed, fails.
+ */
+static int group_flush(database_t *database, uint64_t commit)
 {
-	return offset / PAGE_SIZE;
+	lock_file_t *lock = database->lock;
+	if (commit == 0)
+		return 0;
+	if (lock_mutex(&lock->flush_lock) == -1)
+		return -1;
+
+	if (lock->flushed < commit)
+	{
+		/* give more commits the chance to join */
+		if (database->options.sync_delay > 0)
+			usleep(database->options.sync_delay);
+
+		database_file_t header;
+		uint64_t last;
+		if (lock_mutex(&lock->commit_lock) == 0)
+		{
+			header = lock->committed;
+			last = lock->commits;
+			unlock_mutex(&lock->commit_lock);
+
+			if (fdatasync(database->fd) == 0)
+			{
+				meta_store(database, &header);
+				if (fdatasync(database->fd) == 0)
+					lock->flushed = last;
+			}
+		}
+	}
+
+	/* errno is left by whichever call failed */
+	int r = lock->flushed < commit ? -1 : 0;
+	int error = errno;
+	unlock_mutex(&lock->flush_lock);
+	errno = error;
+	return r;
 }
 
-static transaction_t *start_read_transaction(database_t *database)
+static transaction_t *start_read_transaction(database_t *database,
+		transaction_t *storage)
 {
 	transaction_t *transaction;
-	if ((transaction = malloc(sizeof(transaction_t))) == NULL)
+	if ((transaction = transaction_new(database, TRANSACTION_MODE_READ, storage)) == NULL)
 		return NULL;
-	transaction->read_page = database->file->active_page;
-
-	database->refcount[transaction->read_page] += 1;
 
-	if ((transaction->data = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
-			MAP_SHARED, database->fd, get_page_offset(transaction->read_page))) == MAP_FAILED)
+	/*
+	 * the thread pins versions in a slot of its own, claimed the first time
+	 * and again if another thread took it back; a read started while another
+	 * is running in the thread needs a second one
+	 */
+	transaction_cache_t *cache = transaction_cache_get(database);
+	int resumed = -1;
+	if (cache != NULL && cache->slot != NULL
+			&& (resumed = reader_resume(cache->slot, cache->keeper)) == -1)
+		cache->slot = NULL;
+	if (cache != NULL && cache->slot == NULL
+			&& (cache->slot = reader_claim(database, cache->keeper)) != NULL)
+		resumed = 1;
+	if (resumed == 1)
+	{
+		transaction->slot = cache->slot;
+		transaction->slot_kept = 1;
+	}
+	else if ((transaction->slot = reader_claim(database, 0)) == NULL)
+	{
+		transaction_free(transaction);
 		return NULL;
+	}
+	transaction->read_page = reader_pin(database, transaction->slot);
+	transaction->root = transaction->read_page;
+	transaction->txnid = transaction->slot->txnid;
 
+	STATS_ADD(database, read_started, 1);
 	return transaction;
 }
 
-static void commit_read_transaction(database_t *database, transaction_t *transaction)
+static void read_transaction_end(transaction_t *transaction)
 {
-	assert(transaction->read_page <= database->num_versions);
+	reader_unpin(transaction->slot);
+	if (transaction->slot_kept)
+		reader_keep(transaction->slot);
+	else
+		reader_unclaim(transaction->slot);
+}
 
-	database->refcount[transaction->read_page] -= 1;
-	free(transaction);
+static int commit_read_transaction(database_t *database, transaction_t *transaction)
+{
+	read_transaction_end(transaction);
+	transaction_free(transaction);
+	STATS_ADD(database, read_committed, 1);
+	return 0;
 }
 
 static void cancel_read_transaction(database_t *database, transaction_t *transaction)
 {
-	assert(transaction->read_page <= database->num_versions);
-
-	database->refcount[transaction->read_page] -= 1;
-	free(transaction);
+	read_transaction_end(transaction);
+	transaction_free(transaction);
+	STATS_ADD(database, read_cancelled, 1);
 }
 
-static transaction_t *start_write_transaction(database_t *database)
+static transaction_t *start_write_transaction(database_t *database,
+		transaction_t *storage)
 {
-	struct stat st;
-	int r;
-	if ((r = fstat(database->fd, &st)) == -1)
-		return NULL;
-
 	transaction_t *transaction;
-	if ((transaction = malloc(sizeof(transaction_t))) == NULL)
+	if ((transaction = transaction_new(database, TRANSACTION_MODE_WRITE, storage)) == NULL)
 		return NULL;
-	transaction->write_page = SIZE_MAX;
-	for (size_t i = 0; i < database->num_versions; i++)
-	{
-		if (database->refcount[i] == 0)
-		{
-			transaction->write_page = i;
-			break;
-		}
-	}
 
-	if (transaction->write_page == SIZE_MAX)
+	if (lock_writer(database) == -1)
 	{
-		/* no available pages. resize the file to have a new page */
-		if ((ftruncate(database->fd, st.st_size + PAGE_SIZE)) == -1)
-			return NULL;
-		transaction->write_page = get_page_number(st.st_size);
-		/* if page number is > 100, will need to resize refcount array */
-		if (transaction->write_page > database->num_versions)
-		{
-			database->num_versions += NUM_VERSIONS_INIT;
-			if ((database->refcount = realloc(database->refcount, database->num_versions)) == NULL)
-				return NULL;
-		}
+		transaction_free(transaction);
+		return NULL;
 	}
-	
-	off_t offset = get_page_offset(transaction->write_page);
+	transaction_begin_write(database, transaction);
 
-	if ((transaction->data = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
-			MAP_SHARED, database->fd, offset)) == MAP_FAILED)
+	/* a write transaction replaces the whole tree */
+	if ((transaction->root = btree_new(transaction)) == P_INVALID)
+	{
+		unlock_writer(database);
+		transaction_free(transaction);
 		return NULL;
+	}
 
+	STATS_ADD(database, write_started, 1);
 	return transaction;
 }
 
-static void commit_write_transaction(database_t *database, transaction_t *transaction)
+static int commit_write_transaction(database_t *database, transaction_t *transaction)
 {
-	database->file->active_page = transaction->write_page;
-	free(transaction);
+	uint64_t start = stats_now();
+	uint64_t commit = 0;
+	int r = -1;
+	if (transaction->read_page == P_INVALID
+			|| btree_free(transaction, transaction->read_page) == 0)
+		r = transaction_publish(database, transaction, &commit);
+	unlock_writer(database);
+	if (r == 0)
+		r = group_flush(database, commit);
+	int error = errno;
+	transaction_free(transaction);
+	if (r == 0)
+	{
+		STATS_ADD(database, write_committed, 1);
+		stats_commit_latency(database, stats_now() - start);
+	}
+	errno = error;
+	return r;
 }
 
 static void cancel_write_transaction(database_t *database, transaction_t *transaction)
 {
-	free(transaction);
+	unlock_writer(database);
+	transaction_free(transaction);
+	STATS_ADD(database, write_cancelled, 1);
 }
 
-static transaction_t *start_read_write_transaction(database_t *database)
+static transaction_t *start_read_write_transaction(database_t *database,
+		transaction_t *storage)
 {
-	// XXX: should I instead keep updating database->file to point to the active_page
-	// instead of remapping active_page from the file to a valid place in memory when
-	// I need it?
-	size_t active_page_num = database->file->active_page;
-	off_t active_page_offset = get_page_offset(active_page_num);
-	char *active_page_addr;
-	if ((active_page_addr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
-			MAP_SHARED, database->fd, active_page_offset)) == MAP_FAILED)
+	transaction_t *transaction;
+	if ((transaction = transaction_new(database, TRANSACTION_MODE_RW, storage)) == NULL)
 		return NULL;
-	database->refcount[active_page_num] += 1;
 
-	transaction_t *transaction = start_write_transaction(database);
-	memcpy((char *)transaction->data, active_page_addr, PAGE_SIZE);
-	transaction->read_page = active_page_num;
-	int r;
-	if ((r = munmap(active_page_addr, PAGE_SIZE)) == -1)
+	/*
+	 * the version read cannot be replaced while the write lock is held, so it
+	 * needs no reader slot. pages are copied lazily as the transaction
+	 * modifies the tree
+	 */
+	if (lock_writer(database) == -1)
+	{
+		transaction_free(transaction);
 		return NULL;
+	}
+	transaction_begin_write(database, transaction);
+
+	STATS_ADD(database, rw_started, 1);
 	return transaction;
 }
 
-static void commit_read_write_transaction(database_t *database, transaction_t *transaction)
+static int commit_read_write_transaction(database_t *database, transaction_t *transaction)
 {
-	database->file->active_page = transaction->write_page;
-
-	assert(transaction->read_page <= database->num_versions);
-	database->refcount[transaction->read_page] -= 1;
-	free(transaction);
+	uint64_t start = stats_now();
+	uint64_t commit = 0;
+	int r = 0;
+	if (transaction->root != transaction->read_page || transaction->publish)
+		r = transaction_publish(database, transaction, &commit);
+	unlock_writer(database);
+	if (r == 0)
+		r = group_flush(database, commit);
+	int error = errno;
+	transaction_free(transaction);
+	if (r == 0)
+	{
+		STATS_ADD(database, rw_committed, 1);
+		stats_commit_latency(database, stats_now() - start);
+	}
+	errno = error;
+	return r;
 }
 
 static void cancel_read_write_transaction(database_t *database, transaction_t *transaction)
 {
-	assert(transaction->read_page <= database->num_versions);
-
-	database->refcount[transaction->read_page] -= 1;
-	free(transaction);
+	unlock_writer(database);
+	transaction_free(transaction);
+	STATS_ADD(database, rw_cancelled, 1);
 }
 
 database_t *database_new(char *filename)
+{
+	const database_options_t options = DATABASE_OPTIONS_DEFAULT;
+	return database_new_with(filename, &options);
+}
+
+/* undo whatever database_new_with set up before it failed, keeping errno */
+static database_t *database_abort(database_t *database)
+{
+	int error = errno;
+	if (database->map != NULL)
+		munmap(database->map, database->map_size);
+	if (database->fd != -1)
+		close(database->fd);
+	pthread_key_delete(database->cache_key);
+	while (database->caches != NULL)
+	{
+		transaction_cache_t *cache = database->caches;
+		database->caches = cache->next;
+		transaction_cache_free(cache);
+	}
+	if (database->lock_fd != -1)
+		lock_close(database);
+	pthread_mutex_destroy(&database->cache_lock);
+	stats_close(database);
+	free(database);
+	errno = error;
+	return NULL;
+}
+
+database_t *database_new_with(char *filename, const database_options_t *options)
 {
 	database_t *database;
-	if ((database = malloc(sizeof(database_t))) == NULL)
-		return NULL;
-	database->num_versions = NUM_VERSIONS_INIT;
-	if ((database->refcount = malloc(sizeof(int) * database->num_versions)) == NULL)
+	if ((database = calloc(1, sizeof(database_t))) == NULL)
 		return NULL;
-	for (size_t i = 0; i < database->num_versions; i++)
+	database->options = *options;
+	database->page_size = options->page_size;
+	if (database->page_size < PAGE_SIZE_MIN || database->page_size > PAGE_SIZE_MAX
+			|| (database->page_size & (database->page_size - 1)) != 0
+			|| options->max_readers == 0 || options->max_readers > UINT32_MAX)
 	{
-		database->refcount[i] = 0;
+		free(database);
+		errno = EINVAL;
+		return NULL;
 	}
-
-	if ((database->fd = open(filename, O_RDWR | O_CREAT, 0666)) == -1)
+	int r;
+	if ((r = pthread_key_create(&database->cache_key, transaction_cache_destroy)) != 0)
+	{
+		free(database);
+		errno = r;
 		return NULL;
-
-    int r;
-	if ((r = ftruncate(database->fd, PAGE_SIZE * 2)) == -1)
+	}
+	if ((r = pthread_mutex_init(&database->cache_lock, NULL)) != 0)
+	{
+		pthread_key_delete(database->cache_key);
+		free(database);
+		errno = r;
 		return NULL;
+	}
+	database->fd = -1;
+	database->lock_fd = -1;
+	if (stats_open(database) == -1)
+		return database_abort(database);
 
-	if ((database->file = mmap(NULL, PAGE_SIZE * 2, PROT_READ | PROT_WRITE,
-			MAP_SHARED, database->fd, 0)) == MAP_FAILED)
-		return NULL;
+	/* the first process to open the database reads it from the file */
+	int alone;
+	if ((alone = lock_open(database, filename)) == -1)
+		return database_abort(database);
 
-	database->file->active_page = 1;
+	if ((database->fd = open(filename, O_RDWR | O_CREAT, 0666)) == -1)
+		return database_abort(database);
+
+	/*
+	 * Map the file once into a range large enough for it to grow in: a shared
+	 * mapping may extend past the end of the file, and pages become accessible
+	 * through it as the file is extended. Transactions find their pages by
+	 * offset and never map anything themselves.
+	 */
+	database->map_size = MAP_RESERVE_SIZE;
+	char *map;
+	if ((map = mmap(NULL, database->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, database->fd, 0)) == MAP_FAILED)
+		return database_abort(database);
+	database->map = map;
+	STATS_ADD(database, mmaps, 1);
+	database->file = &database->lock->header;
+	if (!alone)
+	{
+		database->page_size = database->file->page_size;
+		return database;
+	}
 
-	memset(((char *) database->file) + PAGE_SIZE, 0, PAGE_SIZE);
+	struct stat st;
+	if (fstat(database->fd, &st) == -1)
+		return database_abort(database);
+	if (st.st_size > 0)
+	{
+		/* the newest meta page is all there is to recover */
+		if ((size_t) st.st_size < sizeof(meta_t))
+		{
+			errno = EINVAL;
+			return database_abort(database);
+		}
+		database->lock->file_size = st.st_size;
+		if (meta_load(database, database->file) == -1)
+			return database_abort(database);
+	}
+	else
+	{
+		/* start out with an empty tree */
+		size_t size = NUM_META_PAGES * PAGE_SIZE(database);
+		if (ftruncate(database->fd, size) == -1)
+			return database_abort(database);
+		STATS_ADD(database, file_grows, 1);
+		database->lock->file_size = size;
+		database->file->txnid = 0;
+		database->file->page_size = PAGE_SIZE(database);
+		database->file->active_page = P_INVALID;
+		database->file->num_pages = NUM_META_PAGES;
+		database->file->free_head = P_INVALID;
+		database->file->free_used = 0;
+		database->file->free_tail = P_INVALID;
+		transaction_t *transaction;
+		if ((transaction = start_write_transaction(database, NULL)) == NULL
+				|| commit_write_transaction(database, transaction) == -1)
+			return database_abort(database);
+	}
+	if (lock_ready(database) == -1)
+		return database_abort(database);
 
 	return database;
 }
@@ -198,29 +549,97 @@ database_t *database_new(char *filename)
 void database_close(database_t *database)
 {
 	int r;
-	if ((r = munmap(database, PAGE_SIZE)) == -1)
+	if ((r = munmap(database->map, database->map_size)) == -1)
 		return;
-    printf("munmap(buf1): %i\n", r);
-	// XXX: do I need to explicitly free each member of the refcount array?
+	close(database->fd);
+
+	/* the threads still running will not free their caches anymore */
+	pthread_key_delete(database->cache_key);
+	while (database->caches != NULL)
+	{
+		transaction_cache_t *cache = database->caches;
+		database->caches = cache->next;
+		transaction_cache_free(cache);
+	}
+
+	lock_close(database);
+	pthread_mutex_destroy(&database->cache_lock);
+	stats_close(database);
 	free(database);
 }
 
+int database_stats(database_t *database, database_stats_t *stats)
+{
+	stats_sum(database, &stats->counters);
+	stats->page_size = PAGE_SIZE(database);
+
+	/* the writer lock keeps the header and the freelist still */
+	if (lock_writer(database) == -1)
+		return -1;
+	stats->txnid = database->file->txnid;
+	stats->file_size = database->lock->file_size;
+	stats->num_pages = database->file->num_pages;
+
+	stats->free_pages = 0;
+	size_t number = database->file->free_head;
+	size_t used = database->file->free_used;
+	while (number != P_INVALID)
+	{
+		freelist_t *freelist = (freelist_t *) (database->map
+				+ number * PAGE_SIZE(database));
+		stats->free_pages += freelist->count - used;
+		if (number == database->file->free_tail)
+			break;
+		number = freelist->next;
+		used = 0;
+	}
+
+	stats->readers = 0;
+	stats->pinned_versions = 0;
+	stats->oldest_reader = 0;
+	lock_file_t *lock = database->lock;
+	for (size_t i = 0; i < lock->num_readers; i++)
+	{
+		size_t txnid = __atomic_load_n(&lock->readers[i].txnid, __ATOMIC_SEQ_CST);
+		if (txnid == 0)
+			continue;
+		stats->readers += 1;
+		if (stats->oldest_reader == 0 || txnid < stats->oldest_reader)
+			stats->oldest_reader = txnid;
+
+		size_t j = 0;
+		while (j < i && __atomic_load_n(&lock->readers[j].txnid,
+				__ATOMIC_SEQ_CST) != txnid)
+			j++;
+		if (j == i)
+			stats->pinned_versions += 1;
+	}
+	unlock_writer(database);
+	return 0;
+}
+
 transaction_t *start_transaction(database_t *database, TRANSACTION_MODE tm)
+{
+	return start_transaction_with(database, tm, NULL);
+}
+
+transaction_t *start_transaction_with(database_t *database, TRANSACTION_MODE tm,
+		transaction_t *storage)
 {
 	switch (tm)
 	{
 		case TRANSACTION_MODE_READ:
-			return start_read_transaction(database);
+			return start_read_transaction(database, storage);
 		case TRANSACTION_MODE_WRITE:
-			return start_write_transaction(database);
+			return start_write_transaction(database, storage);
 		case TRANSACTION_MODE_RW:
-			return start_read_write_transaction(database);
+			return start_read_write_transaction(database, storage);
 		default:
 			exit(1);
 	}
 }
 
-void commit_transaction(database_t *database, transaction_t *transaction)
+int commit_transaction(database_t *database, transaction_t *transaction)
 {
 	switch (transaction->tm)
 	{
@@ -235,7 +654,7 @@ void commit_transaction(database_t *database, transaction_t *transaction)
 	}
 }
 
-void cancel_transaction(database_t *database, transaction_t *transaction) 
+void cancel_transaction(database_t *database, transaction_t *transaction)
 {
 	switch (transaction->tm)
 	{
@@ -249,3 +668,120 @@ void cancel_transaction(database_t *database, transaction_t *transaction)
 			exit(1);
 	}
 }
+
+int db_get(transaction_t *transaction, const void *key, size_t key_size,
+		const void **value, size_t *value_size)
+{
+	return btree_get(transaction, key, key_size, value, value_size);
+}
+
+int db_multi_get(transaction_t *transaction, const db_item_t *keys, size_t count,
+		db_item_t *values)
+{
+	return btree_get_many(transaction, keys, count, values);
+}
+
+int db_put(transaction_t *transaction, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	if (!(transaction->tm & TRANSACTION_MODE_WRITE))
+	{
+		errno = EACCES;
+		return -1;
+	}
+	return btree_put(transaction, key, key_size, value, value_size);
+}
+
+int db_del(transaction_t *transaction, const void *key, size_t key_size)
+{
+	if (!(transaction->tm & TRANSACTION_MODE_WRITE))
+	{
+		errno = EACCES;
+		return -1;
+	}
+	return btree_del(transaction, key, key_size);
+}
+
+db_cursor_t *db_cursor_open(transaction_t *transaction)
+{
+	db_cursor_t *cursor;
+	if ((cursor = malloc(sizeof(db_cursor_t))) == NULL)
+		return NULL;
+	cursor->transaction = transaction;
+	cursor->path.depth = 0;
+	cursor->key = NULL;
+	return cursor;
+}
+
+void db_cursor_close(db_cursor_t *cursor)
+{
+	free(cursor->key);
+	free(cursor);
+}
+
+int db_cursor_first(db_cursor_t *cursor)
+{
+	return btree_cursor_first(cursor);
+}
+
+int db_cursor_last(db_cursor_t *cursor)
+{
+	return btree_cursor_last(cursor);
+}
+
+int db_cursor_seek(db_cursor_t *cursor, const void *key, size_t key_size)
+{
+	return btree_cursor_seek(cursor, key, key_size);
+}
+
+int db_cursor_seek_last(db_cursor_t *cursor, const void *key, size_t key_size)
+{
+	return btree_cursor_seek_last(cursor, key, key_size);
+}
+
+int db_cursor_next(db_cursor_t *cursor)
+{
+	return btree_cursor_next(cursor);
+}
+
+int db_cursor_prev(db_cursor_t *cursor)
+{
+	return btree_cursor_prev(cursor);
+}
+
+int db_cursor_get(db_cursor_t *cursor, const void **key, size_t *key_size,
+		const void **value, size_t *value_size)
+{
+	return btree_cursor_get(cursor, key, key_size, value, value_size);
+}
+
+db_loader_t *db_loader_open(transaction_t *transaction, unsigned fill_percent)
+{
+	if (!(transaction->tm & TRANSACTION_MODE_WRITE))
+	{
+		errno = EACCES;
+		return NULL;
+	}
+	db_loader_t *loader;
+	if ((loader = malloc(sizeof(db_loader_t))) == NULL)
+		return NULL;
+	loader->transaction = transaction;
+	if (btree_load_start(loader, fill_percent) == -1)
+	{
+		free(loader);
+		return NULL;
+	}
+	return loader;
+}
+
+int db_loader_put(db_loader_t *loader, const void *key, size_t key_size,
+		const void *value, size_t value_size)
+{
+	return btree_load_put(loader, key, key_size, value, value_size);
+}
+
+void db_loader_close(db_loader_t *loader)
+{
+	btree_load_finish(loader);
+	free(loader);
+}
@@ -1,15 +1,142 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
 
 typedef struct database_file_t database_file_t;
+typedef struct db_batch_t db_batch_t;
+typedef struct db_cursor_t db_cursor_t;
+typedef struct db_loader_t db_loader_t;
+typedef struct lock_file_t lock_file_t;
+typedef struct reader_slot_t reader_slot_t;
+typedef struct stats_shard_t stats_shard_t;
+
+/* a key or value passed by address and size */
+typedef struct db_item_t
+{
+	const void *data;
+	size_t size;
+} db_item_t;
+
+typedef struct page_list_t
+{
+	size_t *pages;
+	size_t length;
+	size_t volume; /* sizeof pages array */
+} page_list_t;
+
+/*
+ * How commits reach the disk:
+ * - NONE leaves writing the pages back to the kernel; a system crash can lose
+ *   recent commits or, as pages are written back in any order, damage the file
+ * - ASYNC also starts writing the pages back at each commit, but does not wait
+ * - COMMIT flushes the pages of each commit before writing and flushing the
+ *   header: once commit_transaction returns the commit is durable
+ * - GROUP is as durable as COMMIT, but commits made while a flush is running
+ *   (or within sync_delay microseconds of it) share the next one
+ * Only COMMIT and GROUP survive a system crash; all modes survive the crash of
+ * the process.
+ */
+typedef enum SYNC_MODE
+{
+	SYNC_MODE_NONE,
+	SYNC_MODE_ASYNC,
+	SYNC_MODE_COMMIT,
+	SYNC_MODE_GROUP
+} SYNC_MODE;
+
+/* bounds of the page size, which must be a power of two */
+#define PAGE_SIZE_MIN ((size_t) 1 << 12)
+#define PAGE_SIZE_MAX ((size_t) 1 << 16)
+
+/*
+ * Tunables of an open database. When the file runs out of pages it grows by
+ * grow_percent of its size but at least by grow_step bytes, so large databases
+ * grow geometrically and small ones in chunks.
+ *
+ * The page size only applies to a new database; an existing one keeps the page
+ * size it was created with. Likewise max_readers, the number of threads of
+ * every process that can have a read running at once, is set by the first
+ * process to open the database and holds until the last one closes it.
+ */
+typedef struct database_options_t
+{
+	size_t page_size;
+	size_t grow_step;
+	unsigned grow_percent;
+	SYNC_MODE sync;
+	unsigned sync_delay;
+	size_t max_readers;
+} database_options_t;
+
+#define DATABASE_OPTIONS_DEFAULT { \
+	.page_size = PAGE_SIZE_MIN, \
+	.grow_step = (size_t) 1 << 20, \
+	.grow_percent = 25, \
+	.sync = SYNC_MODE_NONE, \
+	.sync_delay = 0, \
+	.max_readers = 126 \
+}
+
+#define STATS_LATENCY_BUCKETS 32
+
+/*
+ * What the process did with the database since it opened it. Everything is a
+ * uint64_t.
+ */
+typedef struct database_counters_t
+{
+	uint64_t read_started;
+	uint64_t read_committed;
+	uint64_t read_cancelled;
+	uint64_t write_started;
+	uint64_t write_committed;
+	uint64_t write_cancelled;
+	uint64_t rw_started;
+	uint64_t rw_committed;
+	uint64_t rw_cancelled;
+	uint64_t pages_allocated; /* taken from the end of the file */
+	uint64_t pages_reused;    /* taken from the freelist */
+	uint64_t pages_freed;
+	uint64_t pages_prefetched; /* hinted to the kernel ahead of reads */
+	uint64_t file_grows;      /* fallocate or ftruncate calls */
+	uint64_t mmaps;
+	/* commits of write transactions that took [2^i, 2^(i + 1)) ns */
+	uint64_t commit_latency[STATS_LATENCY_BUCKETS];
+} database_counters_t;
+
+/* the counters and the state of the database at one point */
+typedef struct database_stats_t
+{
+	database_counters_t counters;
+	size_t txnid;      /* number of the last commit */
+	size_t page_size;
+	size_t file_size;  /* bytes allocated to the file */
+	size_t num_pages;  /* pages in use, including the free ones */
+	size_t free_pages; /* released pages waiting on the freelist */
+	size_t readers;    /* read transactions running, in any process */
+	size_t pinned_versions; /* distinct versions they read */
+	size_t oldest_reader;   /* txnid of the oldest of them, 0 if none */
+} database_stats_t;
 
 typedef struct database_t {
 	database_file_t *file;
 	int fd;
-	int *refcount;
-	size_t num_versions; /* sizeof refcount array */
+	size_t page_size;
+	char *map;       /* the whole file, mapped once */
+	size_t map_size; /* address space reserved for map */
+	lock_file_t *lock; /* writer lock and reader table, see lock.h */
+	size_t lock_size;
+	int lock_fd;
+	database_options_t options;
+	pthread_key_t cache_key; /* transaction handles kept by each thread */
+	pthread_mutex_t cache_lock;
+	struct transaction_cache_t *caches;
+	stats_shard_t *stats; /* see stats.h */
 } database_t;
 
 typedef enum TRANSACTION_MODE
@@ -21,17 +148,173 @@ typedef enum TRANSACTION_MODE
 
 typedef struct transaction_t
 {
-	void *data;
-	size_t write_page;
-	size_t read_page;
+	database_t *database;
+	size_t root;      /* root page of the tree seen by the transaction */
+	size_t read_page; /* root page of the version the transaction started from */
+	size_t txnid;     /* of that version */
+	size_t oldest;    /* oldest version still in use, 0 until needed */
+	size_t num_pages; /* the freelist and file size as of the transaction */
+	size_t free_head;
+	size_t free_used;
+	size_t free_tail;
+	page_list_t dirty; /* pages allocated by the transaction */
+	page_list_t freed; /* pages of read_page no longer referenced */
+	page_list_t loose; /* dirty pages no longer referenced */
+	page_list_t reclaimed; /* free pages taken ahead of time, see page_reclaim */
+	reader_slot_t *slot; /* held by a read transaction */
+	int slot_kept;       /* the slot stays with the thread afterwards */
 	TRANSACTION_MODE tm;
+	int caller_storage; /* provided to start_transaction_with */
+	int publish;        /* commit even if the tree is unchanged */
 } transaction_t;
 
 database_t *database_new(char *filename);
+database_t *database_new_with(char *filename, const database_options_t *options);
 void database_close(database_t *database);
 
+/*
+ * Fill @stats in. The counters only cover this process; counting is cheap
+ * but gathering them and the state takes the writer lock for a moment.
+ */
+int database_stats(database_t *database, database_stats_t *stats);
+
+/*
+ * Write a consistent copy of the database to @fd, at its current position,
+ * while writers carry on: the pages of the active version and no others, so
+ * the copy is compacted. @fd may be a file, which then holds a database that
+ * can be opened, or a pipe or socket to stream it through.
+ */
+int database_backup(database_t *database, int fd);
+
+/*
+ * Incremental backups. Every page is stamped with the commit that wrote it:
+ * database_export writes the pages of the active version written after commit
+ * @since to @fd, so its cost follows the changes rather than the size of the
+ * database, and sets *@txnid (if not NULL) to the commit exported, which is
+ * where the next export starts from. An export from 0 holds everything.
+ *
+ * database_restore applies one export read from @fd to @database, which must
+ * be open in no other process and have no read running (EBUSY otherwise).
+ * Exports are applied oldest first, from a full one into a new database; one
+ * that does not follow the commit the database is at fails with EINVAL.
+ */
+int database_export(database_t *database, int fd, size_t since, size_t *txnid);
+int database_restore(database_t *database, int fd);
+
+/*
+ * Give the space of free pages back while the database stays in use: the
+ * pages of the tree are moved toward the start of the file by ordinary write
+ * transactions, the file is cut after the last page in use and the free pages
+ * left before it are punched out. Pages a running reader still needs are left
+ * alone, so compacting after long readers end gives back the most.
+ */
+int database_compact(database_t *database);
+
+/*
+ * Transaction handles are recycled through a small cache kept by each thread,
+ * so starting a transaction does not usually allocate. start_transaction_with
+ * starts the transaction in @storage instead, which the caller must keep until
+ * the transaction ends.
+ *
+ * commit_transaction ends the transaction either way. It returns 0 once the
+ * commit is as durable as the sync mode makes it, and -1 with errno set if it
+ * could not be published or flushed: the commit may then be lost, or not be
+ * made at all, and is not counted as committed.
+ */
 transaction_t *start_transaction(database_t *database, TRANSACTION_MODE tm);
-void commit_transaction(database_t *database, transaction_t *transaction);
+transaction_t *start_transaction_with(database_t *database, TRANSACTION_MODE tm,
+		transaction_t *storage);
+int commit_transaction(database_t *database, transaction_t *transaction);
 void cancel_transaction(database_t *database, transaction_t *transaction);
 
+/*
+ * Key/value access inside a transaction. Keys are ordered bytewise (a shorter
+ * key sorts before the longer keys it is a prefix of).
+ *
+ * All of these return 0 on success and -1 with errno set on failure: ENOENT
+ * when the key does not exist (or a cursor runs past the last key), EACCES
+ * when modifying in a read transaction and E2BIG when the key does not fit in
+ * half a page or the value takes 2 GiB or more. Values too big for half a page
+ * are stored in pages of their own, consecutive in the file.
+ *
+ * Keys and values are returned as pointers into the database pages rather than
+ * copied, large values included. They stay valid until the transaction ends,
+ * except in a write transaction, where they are only valid until its next
+ * modification. Leaves store the prefix their keys share once, so a key a
+ * cursor returns may be put together in a buffer of the cursor instead, valid
+ * until it moves.
+ */
+int db_get(transaction_t *transaction, const void *key, size_t key_size,
+		const void **value, size_t *value_size);
+int db_put(transaction_t *transaction, const void *key, size_t key_size,
+		const void *value, size_t value_size);
+int db_del(transaction_t *transaction, const void *key, size_t key_size);
+
+/*
+ * Look up the @count @keys, setting @values[i] to the value of @keys[i], or
+ * its data to NULL if the key does not exist. The lookups share the work of
+ * going down the tree, the more so the closer their keys are, and the pages
+ * they need are read in together rather than one after the other. Fails only
+ * when out of memory.
+ */
+int db_multi_get(transaction_t *transaction, const db_item_t *keys, size_t count,
+		db_item_t *values);
+
+/*
+ * Cursors iterate over the keys of a transaction in order, forward or
+ * backward. A modification of the transaction invalidates its cursors until
+ * they are positioned again. A cursor that keeps moving the same way has the
+ * pages ahead of it read in before it gets there, so scanning a range that is
+ * not in memory yet does not wait on every page.
+ */
+db_cursor_t *db_cursor_open(transaction_t *transaction);
+void db_cursor_close(db_cursor_t *cursor);
+/* position the cursor on the first key */
+int db_cursor_first(db_cursor_t *cursor);
+/* position the cursor on the last key */
+int db_cursor_last(db_cursor_t *cursor);
+/* position the cursor on the first key that is not less than @key */
+int db_cursor_seek(db_cursor_t *cursor, const void *key, size_t key_size);
+/* position the cursor on the last key that is not greater than @key */
+int db_cursor_seek_last(db_cursor_t *cursor, const void *key, size_t key_size);
+/* advance the cursor to the next key */
+int db_cursor_next(db_cursor_t *cursor);
+/* move the cursor back to the previous key */
+int db_cursor_prev(db_cursor_t *cursor);
+/* return the key and value under the cursor (either may be NULL) */
+int db_cursor_get(db_cursor_t *cursor, const void **key, size_t *key_size,
+		const void **value, size_t *value_size);
+
+/*
+ * Bulk loading. A loader fills the tree of a write (or read-write) transaction,
+ * which must still be empty, from entries given in increasing key order
+ * (EINVAL otherwise). Leaves are packed to @fill_percent (50 to 100) of a page,
+ * leaving room for later inserts, and the branches are built bottom-up as the
+ * leaves fill, so no page is ever split or copied and pages are written in
+ * order. db_loader_close completes the tree; the commit of the transaction
+ * then publishes all of it at once. After a failure the transaction should be
+ * cancelled.
+ */
+db_loader_t *db_loader_open(transaction_t *transaction, unsigned fill_percent);
+int db_loader_put(db_loader_t *loader, const void *key, size_t key_size,
+		const void *value, size_t value_size);
+void db_loader_close(db_loader_t *loader);
+
+/*
+ * Write batches. A batch buffers puts and deletes, copying their keys and
+ * values, and db_batch_write applies them in one read-write transaction of its
+ * own: sorted by key, so each page they touch is copied once for the whole
+ * batch, and with only the last operation on a key kept. Deleting a missing key
+ * is not an error. Either the whole batch is committed and emptied or, on
+ * failure, none of it is and it is kept as it was.
+ */
+db_batch_t *db_batch_new(database_t *database);
+void db_batch_free(db_batch_t *batch);
+int db_batch_put(db_batch_t *batch, const void *key, size_t key_size,
+		const void *value, size_t value_size);
+int db_batch_del(db_batch_t *batch, const void *key, size_t key_size);
+/* forget the operations buffered so far */
+void db_batch_clear(db_batch_t *batch);
+int db_batch_write(db_batch_t *batch);
+
 #endif /* DATABASE_H */
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lock.h"
+#include "page.h"
+#include "stats.h"
+
+#define LOCK_SUFFIX "-lock"
+
+/*
+ * Every process holds a read lock on the first byte of the lock file while it
+ * has the database open. The one that manages to take a write lock instead is
+ * alone and sets the files up; open file description locks convert from write
+ * to read atomically, so nobody can slip in between.
+ */
+static int lock_byte(int fd, short type, int cmd)
+{
+	struct flock lock = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 1
+	};
+	return fcntl(fd, cmd, &lock);
+}
+
+static int mutex_init(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+	int r;
+	if ((r = pthread_mutexattr_init(&attr)) != 0
+			|| (r = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) != 0
+			|| (r = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) != 0
+			|| (r = pthread_mutex_init(mutex, &attr)) != 0)
+	{
+		errno = r;
+		return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+	return 0;
+}
+
+static int lock_init(lock_file_t *lock, size_t num_readers)
+{
+	if (mutex_init(&lock->write_lock) == -1
+			|| mutex_init(&lock->commit_lock) == -1
+			|| mutex_init(&lock->flush_lock) == -1)
+		return -1;
+
+	lock->num_readers = num_readers;
+	for (size_t i = 0; i < lock->num_readers; i++)
+	{
+		lock->readers[i].txnid = 0;
+		lock->readers[i].pid = 0;
+		lock->readers[i].keeper = 0;
+	}
+	return 0;
+}
+
+/* undo what lock_open set up; closing the file drops its lock */
+static int lock_abort(database_t *database)
+{
+	int error = errno;
+	if (database->lock != NULL)
+		munmap(database->lock, database->lock_size);
+	close(database->lock_fd);
+	database->lock = NULL;
+	database->lock_fd = -1;
+	errno = error;
+	return -1;
+}
+
+int lock_open(database_t *database, const char *filename)
+{
+	char *name;
+	if ((name = malloc(strlen(filename) + sizeof(LOCK_SUFFIX))) == NULL)
+		return -1;
+	strcpy(name, filename);
+	strcat(name, LOCK_SUFFIX);
+	database->lock_fd = open(name, O_RDWR | O_CREAT, 0666);
+	free(name);
+	if (database->lock_fd == -1)
+		return -1;
+	database->lock = NULL;
+
+	int alone = 1;
+	if (lock_byte(database->lock_fd, F_WRLCK, F_OFD_SETLK) == -1)
+	{
+		if (errno != EAGAIN && errno != EACCES)
+			return lock_abort(database);
+		/* wait until whoever is alone is done setting up */
+		if (lock_byte(database->lock_fd, F_RDLCK, F_OFD_SETLKW) == -1)
+			return lock_abort(database);
+		alone = 0;
+	}
+
+	/* the size of the reader table is the one the file was created with */
+	size_t num_readers = database->options.max_readers;
+	struct stat st;
+	if (!alone && fstat(database->lock_fd, &st) == -1)
+		return lock_abort(database);
+	database->lock_size = alone
+			? sizeof(lock_file_t) + num_readers * sizeof(reader_slot_t) : (size_t) st.st_size;
+	if (database->lock_size < sizeof(lock_file_t))
+	{
+		errno = EINVAL;
+		return lock_abort(database);
+	}
+	if (alone && (ftruncate(database->lock_fd, 0) == -1
+			|| ftruncate(database->lock_fd, database->lock_size) == -1))
+		return lock_abort(database);
+	lock_file_t *lock;
+	if ((lock = mmap(NULL, database->lock_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, database->lock_fd, 0)) == MAP_FAILED)
+		return lock_abort(database);
+	database->lock = lock;
+	STATS_ADD(database, mmaps, 1);
+	if (alone && lock_init(database->lock, num_readers) == -1)
+		return lock_abort(database);
+	if (sizeof(lock_file_t) + database->lock->num_readers * sizeof(reader_slot_t)
+			> database->lock_size)
+	{
+		errno = EINVAL;
+		return lock_abort(database);
+	}
+	return alone;
+}
+
+int lock_ready(database_t *database)
+{
+	return lock_byte(database->lock_fd, F_RDLCK, F_OFD_SETLK);
+}
+
+int lock_exclusive(database_t *database)
+{
+	if (lock_byte(database->lock_fd, F_WRLCK, F_OFD_SETLK) == -1)
+	{
+		if (errno == EAGAIN || errno == EACCES)
+			errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+void lock_close(database_t *database)
+{
+	munmap(database->lock, database->lock_size);
+	/* also drops the read lock */
+	close(database->lock_fd);
+}
+
+int lock_mutex(pthread_mutex_t *mutex)
+{
+	int r = pthread_mutex_lock(mutex);
+	/*
+	 * the previous owner died. whatever the mutexes guard is only updated once
+	 * it is complete (a transaction works on a copy of the header until it
+	 * publishes), so there is nothing to undo
+	 */
+	if (r == EOWNERDEAD)
+		r = pthread_mutex_consistent(mutex);
+	if (r != 0)
+	{
+		errno = r;
+		return -1;
+	}
+	return 0;
+}
+
+void unlock_mutex(pthread_mutex_t *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+int lock_writer(database_t *database)
+{
+	return lock_mutex(&database->lock->write_lock);
+}
+
+void unlock_writer(database_t *database)
+{
+	unlock_mutex(&database->lock->write_lock);
+}
+
+/* spread the threads over the reader table so they do not contend for slots */
+static size_t reader_hint(void)
+{
+	static size_t next;
+	static __thread size_t hint = SIZE_MAX;
+	if (hint == SIZE_MAX)
+		hint = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) + getpid();
+	return hint;
+}
+
+/* free @slot if the process holding it is gone without releasing it */
+static int reader_reap(reader_slot_t *slot)
+{
+	pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_SEQ_CST);
+	pid_t self = getpid();
+	if (pid == 0 || pid == self || kill(pid, 0) == 0 || errno != ESRCH)
+		return 0;
+	/*
+	 * take the slot before clearing it: another reaper may have freed it
+	 * already and a live reader claimed and pinned it since
+	 */
+	if (!__atomic_compare_exchange_n(&slot->pid, &pid, self, 0, __ATOMIC_SEQ_CST,
+			__ATOMIC_RELAXED))
+		return 0;
+	__atomic_store_n(&slot->txnid, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&slot->keeper, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&slot->pid, 0, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/*
+ * take @slot over for @keeper if the thread of the process keeping it is
+ * between reads; that thread finds out when it resumes. A slot being reaped
+ * carries the pid of the reaper but still the keeper of the dead process.
+ */
+static int reader_take_back(reader_slot_t *slot, pid_t pid, uint64_t keeper)
+{
+	uint64_t kept = __atomic_load_n(&slot->keeper, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&slot->pid, __ATOMIC_SEQ_CST) == pid
+			&& (kept & READER_IDLE) && kept >> 32 == (uint64_t) pid
+			&& __atomic_load_n(&slot->txnid, __ATOMIC_SEQ_CST) == 0
+			&& __atomic_compare_exchange_n(&slot->keeper, &kept, keeper, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* claiming a slot is a single compare-and-swap on its owner */
+reader_slot_t *reader_claim(database_t *database, uint64_t keeper)
+{
+	lock_file_t *lock = database->lock;
+	pid_t pid = getpid();
+	size_t start = reader_hint();
+	for (int reaped = 0; reaped < 2; reaped++)
+	{
+		for (size_t i = 0; i < lock->num_readers; i++)
+		{
+			reader_slot_t *slot = &lock->readers[(start + i) % lock->num_readers];
+			pid_t expected = 0;
+			if (__atomic_compare_exchange_n(&slot->pid, &expected, pid, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			{
+				__atomic_store_n(&slot->keeper, keeper, __ATOMIC_SEQ_CST);
+				return slot;
+			}
+		}
+
+		/*
+		 * the table is full: take back a slot kept idle by a thread of the
+		 * process, or else the slots of dead processes, once
+		 */
+		for (size_t i = 0; i < lock->num_readers; i++)
+		{
+			reader_slot_t *slot = &lock->readers[(start + i) % lock->num_readers];
+			if (reader_take_back(slot, pid, keeper))
+				return slot;
+		}
+		for (size_t i = 0; i < lock->num_readers; i++)
+			reader_reap(&lock->readers[i]);
+	}
+	errno = EAGAIN;
+	return NULL;
+}
+
+void reader_unclaim(reader_slot_t *slot)
+{
+	/* a slot released while pinned would hold every writer back for good */
+	__atomic_store_n(&slot->txnid, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->keeper, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+}
+
+void reader_keep(reader_slot_t *slot)
+{
+	__atomic_fetch_or(&slot->keeper, READER_IDLE, __ATOMIC_RELEASE);
+}
+
+int reader_resume(reader_slot_t *slot, uint64_t keeper)
+{
+	uint64_t idle = keeper | READER_IDLE;
+	if (__atomic_compare_exchange_n(&slot->keeper, &idle, keeper, 0, __ATOMIC_SEQ_CST,
+			__ATOMIC_RELAXED))
+		return 1;
+	return idle == keeper ? 0 : -1;
+}
+
+/*
+ * The txnid is checked again after it is stored since a writer that replaced
+ * the version in the meantime may not have seen the slot. The root is read
+ * last: a commit stores its root before its txnid, so the root read belongs to
+ * the pinned version or a newer one, and newer ones are kept as well.
+ */
+size_t reader_pin(database_t *database, reader_slot_t *slot)
+{
+	size_t txnid, active = __atomic_load_n(&database->file->txnid, __ATOMIC_SEQ_CST);
+	do
+	{
+		txnid = active;
+		__atomic_store_n(&slot->txnid, txnid, __ATOMIC_SEQ_CST);
+	} while ((active = __atomic_load_n(&database->file->txnid,
+			__ATOMIC_SEQ_CST)) != txnid);
+	return __atomic_load_n(&database->file->active_page, __ATOMIC_SEQ_CST);
+}
+
+void reader_unpin(reader_slot_t *slot)
+{
+	__atomic_store_n(&slot->txnid, 0, __ATOMIC_RELEASE);
+}
+
+size_t reader_oldest(database_t *database)
+{
+	lock_file_t *lock = database->lock;
+	size_t oldest = SIZE_MAX;
+	for (size_t i = 0; i < lock->num_readers; i++)
+	{
+		reader_slot_t *slot = &lock->readers[i];
+		size_t txnid = __atomic_load_n(&slot->txnid, __ATOMIC_SEQ_CST);
+		/* only a reader that would hold the others back is checked for life */
+		if (txnid != 0 && txnid < oldest && !reader_reap(slot))
+			oldest = txnid;
+	}
+	return oldest;
+}
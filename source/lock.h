@@ -0,0 +1,107 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "database.h"
+#include "page.h"
+
+/*
+ * State shared by every process that has a database open lives in a lock file
+ * next to it (`<filename>-lock`), mapped by each of them: the writer lock, the
+ * live header and the reader table.
+ *
+ * Transactions start from and publish to the live header. The header in the
+ * data file is only written once the pages of the version it names are on
+ * disk, which with group commit can be some commits later.
+ *
+ * A read transaction pins the version it reads by storing its txnid in a slot
+ * of the reader table. A thread keeps the slot it claimed for as long as it
+ * runs, so starting a read is mostly a compare-and-swap and a store to a cache
+ * line nobody else writes. Writers reuse the pages released before the oldest
+ * pinned version.
+ *
+ * The table has max_readers slots, set when the lock file is created. Once
+ * they are all claimed, a thread that needs one takes it back from another
+ * thread of its process that keeps it between reads; that thread then claims
+ * another one for its next read.
+ */
+struct reader_slot_t
+{
+	size_t txnid; /* version pinned by the running read, 0 if none */
+	pid_t pid;    /* process holding the slot, 0 if free */
+	/*
+	 * the thread keeping the slot (see reader_keep), with READER_IDLE while
+	 * none of its reads runs; 0 if the slot is only claimed for one read
+	 */
+	uint64_t keeper;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define READER_IDLE UINT64_C(1)
+
+struct lock_file_t
+{
+	/* robust and process-shared: held by the running write transaction */
+	pthread_mutex_t write_lock;
+	database_file_t header;
+	size_t file_size;     /* bytes allocated to the data file */
+
+	/* group commit: the header of the last commit and the commits made */
+	pthread_mutex_t commit_lock;
+	database_file_t committed;
+	uint64_t commits;
+	/* held while flushing: the commits made durable */
+	pthread_mutex_t flush_lock;
+	uint64_t flushed;
+
+	uint32_t num_readers; /* sizeof readers array */
+	reader_slot_t readers[];
+};
+
+/*
+ * Open and map the lock file of the database @filename, creating it if needed.
+ * Return 1 if no other process has the database open (the caller is then the
+ * only one to see it until lock_ready), 0 if others do and -1 on failure,
+ * with the lock file closed again.
+ */
+int lock_open(database_t *database, const char *filename);
+/* let the other processes open the database */
+int lock_ready(database_t *database);
+/*
+ * Keep other processes from opening the database until lock_ready; EBUSY if
+ * some have it open already.
+ */
+int lock_exclusive(database_t *database);
+void lock_close(database_t *database);
+
+int lock_writer(database_t *database);
+void unlock_writer(database_t *database);
+
+/* lock one of the robust mutexes of the lock file */
+int lock_mutex(pthread_mutex_t *mutex);
+void unlock_mutex(pthread_mutex_t *mutex);
+
+/*
+ * Claim a free reader slot for the process, or an idle one kept by another of
+ * its threads, for @keeper (EAGAIN if there is none). A @keeper is unique to
+ * the thread and has READER_IDLE clear; 0 claims the slot for one read.
+ */
+reader_slot_t *reader_claim(database_t *database, uint64_t keeper);
+void reader_unclaim(reader_slot_t *slot);
+/* keep @slot, unpinned, for the next read of its keeper */
+void reader_keep(reader_slot_t *slot);
+/*
+ * Take @slot up for a read of @keeper again: return 1 if it was idle, 0 if a
+ * read of @keeper is running in it and -1 if another thread took it back.
+ */
+int reader_resume(reader_slot_t *slot, uint64_t keeper);
+/* pin the active version in @slot; return its root page */
+size_t reader_pin(database_t *database, reader_slot_t *slot);
+void reader_unpin(reader_slot_t *slot);
+/* the txnid of the oldest version pinned by a reader, SIZE_MAX if none is */
+size_t reader_oldest(database_t *database);
+
+#endif /* LOCK_H */
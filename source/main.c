@@ -8,7 +8,7 @@ int main(void)
 {
 	database_t *db = database_new("/tmp/example2");
 	transaction_t *transaction = start_transaction(db, TRANSACTION_MODE_WRITE);
-	strcpy((char *)transaction->data, "something\n");
+	db_put(transaction, "something", strlen("something"), "\n", 1);
 	commit_transaction(db, transaction);
 	database_close(db);
 
@@ -0,0 +1,515 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "lock.h"
+#include "page.h"
+#include "stats.h"
+
+#define PAGE_LIST_INIT 16
+/* reclaimed pages a run of pages is looked for among before growing the file */
+#define RUN_SEARCH_PAGES 256
+
+static off_t get_page_offset(database_t *database, size_t number)
+{
+	return number * PAGE_SIZE(database);
+}
+
+static size_t freelist_capacity(database_t *database)
+{
+	return (PAGE_SIZE(database) - sizeof(freelist_t)) / sizeof(uint64_t);
+}
+
+int page_list_push(page_list_t *list, size_t number)
+{
+	if (list->length == list->volume)
+	{
+		size_t volume = list->volume ? list->volume * 2 : PAGE_LIST_INIT;
+		size_t *pages;
+		if ((pages = realloc(list->pages, volume * sizeof(size_t))) == NULL)
+			return -1;
+		list->pages = pages;
+		list->volume = volume;
+	}
+	list->pages[list->length++] = number;
+	return 0;
+}
+
+void page_list_clear(page_list_t *list)
+{
+	free(list->pages);
+	list->pages = NULL;
+	list->length = list->volume = 0;
+}
+
+page_t *page_get(transaction_t *transaction, size_t number)
+{
+	database_t *database = transaction->database;
+	assert((size_t) get_page_offset(database, number) < database->map_size);
+	return (page_t *) (database->map + get_page_offset(database, number));
+}
+
+void page_prefetch(transaction_t *transaction, const size_t *numbers, size_t count)
+{
+	database_t *database = transaction->database;
+	uintptr_t mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+	for (size_t i = 0, run; i < count; i += run)
+	{
+		run = 1;
+		while (i + run < count && numbers[i + run] == numbers[i] + run)
+			run++;
+		char *start = (char *) page_get(transaction, numbers[i]);
+		char *end = start + run * PAGE_SIZE(database);
+		start = (char *) ((uintptr_t) start & mask);
+		madvise(start, end - start, MADV_WILLNEED);
+	}
+	STATS_ADD(database, pages_prefetched, count);
+}
+
+int page_resident(transaction_t *transaction, size_t number)
+{
+	uintptr_t mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+	unsigned char resident;
+	char *start = (char *) ((uintptr_t) page_get(transaction, number) & mask);
+	if (mincore(start, 1, &resident) == -1)
+		return 1;
+	return resident & 1;
+}
+
+static meta_t *meta_get(database_t *database, size_t index)
+{
+	return (meta_t *) (database->map + get_page_offset(database, index));
+}
+
+/* 64-bit FNV-1a */
+static uint64_t meta_checksum(const meta_t *meta)
+{
+	const unsigned char *bytes = (const unsigned char *) meta;
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < offsetof(meta_t, checksum); i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3;
+	return hash;
+}
+
+static int meta_valid(const meta_t *meta)
+{
+	size_t page_size = meta->header.page_size;
+	return meta->magic == META_MAGIC && meta->format == META_FORMAT
+			&& meta->checksum == meta_checksum(meta)
+			&& page_size >= PAGE_SIZE_MIN && page_size <= PAGE_SIZE_MAX
+			&& (page_size & (page_size - 1)) == 0;
+}
+
+/* find the page size of the file from whichever meta page is valid */
+static int meta_probe(database_t *database)
+{
+	meta_t *first = (meta_t *) database->map;
+	if (meta_valid(first))
+	{
+		database->page_size = first->header.page_size;
+		return 0;
+	}
+
+	for (size_t size = PAGE_SIZE_MIN; size <= PAGE_SIZE_MAX; size *= 2)
+	{
+		meta_t *second = (meta_t *) (database->map + size);
+		if (size + sizeof(meta_t) <= database->lock->file_size && meta_valid(second)
+				&& second->header.page_size == size)
+		{
+			database->page_size = size;
+			return 0;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/* index of the meta page with the newest valid header, -1 if none */
+static int meta_newest(database_t *database)
+{
+	int newest = -1;
+	for (int i = 0; i < NUM_META_PAGES; i++)
+	{
+		meta_t *meta = meta_get(database, i);
+		if (meta_valid(meta) && (newest == -1
+				|| meta->header.txnid > meta_get(database, newest)->header.txnid))
+			newest = i;
+	}
+	return newest;
+}
+
+int meta_load(database_t *database, database_file_t *header)
+{
+	if (meta_probe(database) == -1)
+		return -1;
+
+	/* the second meta page may lie past the end of a damaged file */
+	int newest;
+	if (NUM_META_PAGES * PAGE_SIZE(database) > database->lock->file_size
+			|| (newest = meta_newest(database)) == -1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	*header = meta_get(database, newest)->header;
+	return 0;
+}
+
+void meta_init(meta_t *meta, const database_file_t *header)
+{
+	meta->magic = META_MAGIC;
+	meta->format = META_FORMAT;
+	meta->header = *header;
+	meta->checksum = meta_checksum(meta);
+}
+
+void meta_store(database_t *database, const database_file_t *header)
+{
+	int newest = meta_newest(database);
+	if (newest != -1 && meta_get(database, newest)->header.txnid >= header->txnid)
+		return;
+
+	meta_init(meta_get(database, newest == 0 ? 1 : 0), header);
+}
+
+/* the txnid of the older meta page, which a crash could go back to */
+static size_t meta_oldest(database_t *database)
+{
+	size_t oldest = SIZE_MAX;
+	for (int i = 0; i < NUM_META_PAGES; i++)
+	{
+		/* the one being written is not whole and would not be gone back to */
+		meta_t *meta = meta_get(database, i);
+		if (meta_valid(meta) && meta->header.txnid < oldest)
+			oldest = meta->header.txnid;
+	}
+	return oldest;
+}
+
+/*
+ * The file is grown ahead of time, with its size kept in the lock file (under
+ * the writer lock), so that most new pages cost no system call at all and the
+ * extents of the file stay contiguous.
+ */
+int file_reserve(database_t *database, size_t size)
+{
+	lock_file_t *lock = database->lock;
+	if (size <= lock->file_size)
+		return 0;
+	if (size > database->map_size)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+
+	size_t grow = lock->file_size / 100 * database->options.grow_percent;
+	if (grow < database->options.grow_step)
+		grow = database->options.grow_step;
+	size_t page_size = PAGE_SIZE(database);
+	size_t target = lock->file_size + (grow + page_size - 1) / page_size * page_size;
+	if (target < size)
+		target = size;
+	if (target > database->map_size)
+		target = database->map_size;
+
+	int r = posix_fallocate(database->fd, lock->file_size, target - lock->file_size);
+	/* the file system cannot preallocate, at least extend the file */
+	if ((r == EOPNOTSUPP || r == EINVAL) && ftruncate(database->fd, target) == 0)
+		r = 0;
+	if (r != 0)
+	{
+		errno = r;
+		return -1;
+	}
+	lock->file_size = target;
+	STATS_ADD(database, file_grows, 1);
+	return 0;
+}
+
+/*
+ * Versions older than every reader and every meta page are unused and stay so
+ * (readers only start on the active version and meta pages only move forward),
+ * so this is worked out once per transaction. The version the transaction
+ * started from counts as pinned.
+ */
+static size_t transaction_oldest(transaction_t *transaction)
+{
+	if (transaction->oldest == 0)
+	{
+		database_t *database = transaction->database;
+		size_t oldest = transaction->txnid, txnid;
+		if ((txnid = reader_oldest(database)) < oldest)
+			oldest = txnid;
+		if ((txnid = meta_oldest(database)) < oldest)
+			oldest = txnid;
+		transaction->oldest = oldest;
+	}
+	return transaction->oldest;
+}
+
+/* release the exhausted freelist page at the head like any other page */
+static int freelist_advance(transaction_t *transaction)
+{
+	freelist_t *head = (freelist_t *) page_get(transaction, transaction->free_head);
+	if (page_list_push(&transaction->freed, transaction->free_head) == -1)
+		return -1;
+	if (transaction->free_head == transaction->free_tail)
+		transaction->free_head = transaction->free_tail = P_INVALID;
+	else
+		transaction->free_head = head->next;
+	transaction->free_used = 0;
+	return 0;
+}
+
+/*
+ * Take a page from the head of the freelist. The pages of a freelist page can
+ * be reused once its version is older than the oldest one pinned; as the
+ * freelist is ordered by txnid, that releases the pages of every version
+ * before it in one go, with a single comparison per freelist page. Freelist
+ * pages written by the transaction itself hold pages of the version it
+ * started from and are never taken from.
+ */
+static size_t freelist_pop(transaction_t *transaction)
+{
+	database_t *database = transaction->database;
+	while (transaction->free_head != P_INVALID)
+	{
+		freelist_t *head = (freelist_t *) page_get(transaction, transaction->free_head);
+		if (head->txnid >= transaction_oldest(transaction))
+			return P_INVALID;
+
+		if (transaction->free_used < head->count)
+		{
+			STATS_ADD(database, pages_reused, 1);
+			return head->pages[transaction->free_used++];
+		}
+
+		if (freelist_advance(transaction) == -1)
+			return P_INVALID;
+	}
+	return P_INVALID;
+}
+
+static int number_compare_reverse(const void *a, const void *b)
+{
+	size_t x = *(const size_t *) a, y = *(const size_t *) b;
+	return (x < y) - (x > y);
+}
+
+/*
+ * Take reusable pages off the freelist into transaction->reclaimed until it
+ * holds @count of them. Freelist pages are taken whole, so that the head is
+ * left one nothing was taken from, as page_retire expects.
+ */
+static int freelist_reclaim(transaction_t *transaction, size_t count)
+{
+	page_list_t *reclaimed = &transaction->reclaimed;
+	size_t number, length = reclaimed->length;
+	while (reclaimed->length < count || transaction->free_used > 0)
+	{
+		if ((number = freelist_pop(transaction)) == P_INVALID)
+			break;
+		if (page_list_push(reclaimed, number) == -1)
+			return -1;
+		freelist_t *head = (freelist_t *) page_get(transaction, transaction->free_head);
+		if (transaction->free_used == head->count && freelist_advance(transaction) == -1)
+			return -1;
+	}
+	/* called again, it mostly finds nothing new */
+	if (reclaimed->length != length)
+		qsort(reclaimed->pages, reclaimed->length, sizeof(size_t), number_compare_reverse);
+	return 0;
+}
+
+int page_reclaim(transaction_t *transaction)
+{
+	return freelist_reclaim(transaction, SIZE_MAX);
+}
+
+size_t page_allocate(transaction_t *transaction)
+{
+	database_t *database = transaction->database;
+	size_t number;
+
+	/* loose pages are already on the dirty list */
+	if (transaction->loose.length > 0)
+		return transaction->loose.pages[--transaction->loose.length];
+
+	if (transaction->reclaimed.length > 0)
+		number = transaction->reclaimed.pages[--transaction->reclaimed.length];
+	else if ((number = freelist_pop(transaction)) == P_INVALID)
+	{
+		/* no available pages. take the next one, the mapping already covers it */
+		number = transaction->num_pages;
+		if (file_reserve(database, get_page_offset(database, number + 1)) == -1)
+			return P_INVALID;
+		transaction->num_pages += 1;
+		STATS_ADD(database, pages_allocated, 1);
+	}
+
+	if (page_list_push(&transaction->dirty, number) == -1)
+		return P_INVALID;
+	return number;
+}
+
+size_t page_take_run(transaction_t *transaction, size_t count, size_t limit)
+{
+	page_list_t *reclaimed = &transaction->reclaimed;
+	/* highest first: a run is @count entries counting down by one */
+	for (size_t i = reclaimed->length; i >= count; i--)
+	{
+		size_t *run = reclaimed->pages + i - count;
+		if (run[count - 1] + count > limit)
+			break;
+		if (run[0] != run[count - 1] + count - 1)
+			continue;
+		size_t number = run[count - 1];
+		memmove(run, run + count, (reclaimed->length - i) * sizeof(size_t));
+		reclaimed->length -= count;
+		return number;
+	}
+	return P_INVALID;
+}
+
+size_t page_allocate_run(transaction_t *transaction, size_t count)
+{
+	database_t *database = transaction->database;
+	size_t number;
+	if (count == 1)
+		return page_allocate(transaction);
+
+	/*
+	 * the freelist only hands out pages one at a time, so runs are looked for
+	 * among a bounded number of reclaimed pages; gathering the rest of the
+	 * free space is left to database_compact
+	 */
+	if (freelist_reclaim(transaction, RUN_SEARCH_PAGES) == -1)
+		return P_INVALID;
+	if ((number = page_take_run(transaction, count, P_INVALID)) == P_INVALID)
+	{
+		number = transaction->num_pages;
+		if (file_reserve(database, get_page_offset(database, number + count)) == -1)
+			return P_INVALID;
+		transaction->num_pages += count;
+		STATS_ADD(database, pages_allocated, count);
+	}
+
+	if (page_list_push(&transaction->dirty, number) == -1)
+		return P_INVALID;
+	return number;
+}
+
+size_t page_span(page_t *page)
+{
+	return (page->flags & PAGE_OVERFLOW) ? ((overflow_t *) page)->count : 1;
+}
+
+int page_free(transaction_t *transaction, size_t number)
+{
+	STATS_ADD(transaction->database, pages_freed, 1);
+	/* a page the transaction allocated was never seen by anyone else */
+	if (page_get(transaction, number)->flags & PAGE_DIRTY)
+		return page_list_push(&transaction->loose, number);
+	return page_list_push(&transaction->freed, number);
+}
+
+int page_free_run(transaction_t *transaction, size_t number, size_t count)
+{
+	if (!(page_get(transaction, number)->flags & PAGE_DIRTY))
+	{
+		STATS_ADD(transaction->database, pages_freed, count);
+		for (size_t i = 0; i < count; i++)
+		{
+			if (page_list_push(&transaction->freed, number + i) == -1)
+				return -1;
+		}
+		return 0;
+	}
+
+	/* loose pages are on the dirty list, which only the first page of a run was */
+	if (page_free(transaction, number) == -1)
+		return -1;
+	STATS_ADD(transaction->database, pages_freed, count - 1);
+	for (size_t i = 1; i < count; i++)
+	{
+		if (page_list_push(&transaction->dirty, number + i) == -1
+				|| page_list_push(&transaction->loose, number + i) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* start a freelist page for pages released from version @txnid */
+static freelist_t *freelist_new(transaction_t *transaction, size_t txnid, size_t *number)
+{
+	if ((*number = page_allocate(transaction)) == P_INVALID)
+		return NULL;
+	freelist_t *freelist = (freelist_t *) page_get(transaction, *number);
+	freelist->flags = PAGE_FREELIST | PAGE_DIRTY;
+	freelist->reserved = 0;
+	freelist->txnid = txnid;
+	freelist->next = P_INVALID;
+	freelist->count = 0;
+	return freelist;
+}
+
+int page_retire(transaction_t *transaction)
+{
+	size_t capacity = freelist_capacity(transaction->database);
+	size_t number;
+	freelist_t *freelist;
+
+	/* loose pages could be reused right away but are not worth a list of their own */
+	for (size_t i = 0; i < transaction->loose.length; i++)
+	{
+		if (page_list_push(&transaction->freed, transaction->loose.pages[i]) == -1)
+			return -1;
+	}
+	transaction->loose.length = 0;
+
+	/* allocating a freelist page can release an exhausted one, so loop */
+	size_t written = 0;
+	while (written < transaction->freed.length)
+	{
+		if ((freelist = freelist_new(transaction, transaction->txnid, &number)) == NULL)
+			return -1;
+		while (written < transaction->freed.length && freelist->count < capacity)
+			freelist->pages[freelist->count++] = transaction->freed.pages[written++];
+
+		/* the old tail keeps its place for whoever reads the previous state */
+		if (transaction->free_tail == P_INVALID)
+		{
+			transaction->free_head = number;
+			transaction->free_used = 0;
+		}
+		else
+			((freelist_t *) page_get(transaction, transaction->free_tail))->next = number;
+		transaction->free_tail = number;
+	}
+	transaction->freed.length = 0;
+
+	/*
+	 * reclaimed pages left over (once they provided the freelist pages above)
+	 * are used by no version, so they go back in front of the queue, tagged to
+	 * be reusable right away, lowest first. the head can only be one nothing
+	 * was taken from yet, as it would have been reclaimed otherwise
+	 */
+	while (transaction->reclaimed.length > 0)
+	{
+		if ((freelist = freelist_new(transaction, 0, &number)) == NULL)
+			return -1;
+		while (transaction->reclaimed.length > 0 && freelist->count < capacity)
+			freelist->pages[freelist->count++] =
+					transaction->reclaimed.pages[--transaction->reclaimed.length];
+
+		freelist->next = transaction->free_head;
+		if (transaction->free_tail == P_INVALID)
+			transaction->free_tail = number;
+		transaction->free_head = number;
+		transaction->free_used = 0;
+	}
+	return 0;
+}
@@ -0,0 +1,184 @@
+#ifndef PAGE_H
+#define PAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "database.h"
+
+#define PAGE_SIZE(database) ((database)->page_size)
+/* address space reserved for the mapping of the file, i.e. its maximum size */
+#define MAP_RESERVE_SIZE ((size_t) 1 << (sizeof(size_t) > 4 ? 36 : 30))
+
+/* sentinel page number: no page */
+#define P_INVALID SIZE_MAX
+
+typedef enum PAGE_FLAG
+{
+	PAGE_BRANCH   = (1 << 0),
+	PAGE_LEAF     = (1 << 1),
+	PAGE_FREELIST = (1 << 2),
+	PAGE_OVERFLOW = (1 << 3),
+	/* the page was allocated by the running write transaction and can be
+	 * modified in place */
+	PAGE_DIRTY    = (1 << 15)
+} PAGE_FLAG;
+
+/*
+ * Every tree page starts with this header. The slot array grows up from the
+ * header and holds the offsets of the entries, which are packed down from the
+ * end of the page. The free space of a page is the gap between lower and upper.
+ *
+ * Pages are stamped with the commit that wrote them. As a commit copies the
+ * path to every page it changes, a branch written before some commit has no
+ * page below it written later either.
+ */
+typedef struct page_t
+{
+	uint16_t flags;
+	uint16_t count;    /* number of entries */
+	uint32_t lower;    /* end of the slot array */
+	uint32_t upper;    /* start of the entries */
+	uint32_t prefix;   /* bytes every key of the page starts with */
+	uint64_t txnid;    /* of the commit that wrote the page */
+	char data[];       /* the prefix of a leaf and the slots, see btree.c */
+} page_t;
+
+/*
+ * Pages released by commits are queued in a list of freelist pages stored in
+ * the file, oldest first. A freelist page holds the pages released by one
+ * commit from the version it replaced, tagged with the txnid of that version,
+ * so the queue is ordered by txnid too. Pages are taken from the head (the
+ * header records how many were taken already) and each commit appends after
+ * the tail, so allocating and releasing a page are both O(1).
+ */
+typedef struct freelist_t
+{
+	uint16_t flags;
+	uint16_t reserved;
+	uint32_t count;
+	uint64_t txnid;   /* of the version the pages were released from */
+	uint64_t next;    /* only meaningful before the tail */
+	uint64_t pages[];
+} freelist_t;
+
+/*
+ * A value too big for a leaf is stored in a run of consecutive pages of its
+ * own, which starts with this header and goes on with the value, so the value
+ * can be read in place through the mapping. The leaf only holds the number of
+ * the first page. Runs are never modified: a new value gets a new run. The
+ * txnid is where page_t has it, so runs are stamped like tree pages.
+ */
+typedef struct overflow_t
+{
+	uint16_t flags;
+	uint16_t reserved;
+	uint32_t count;   /* pages of the run */
+	uint64_t size;    /* bytes of the value */
+	uint64_t txnid;   /* of the commit that wrote the run */
+	char data[];
+} overflow_t;
+
+/* the header of the database; the live one is in the lock file */
+struct database_file_t
+{
+	size_t txnid;       /* number of the last commit */
+	size_t page_size;
+	size_t active_page; /* root page of the tree */
+	size_t num_pages;   /* pages in use, including the header */
+	size_t free_head;   /* freelist page pages are taken from */
+	size_t free_used;   /* pages already taken from free_head */
+	size_t free_tail;   /* freelist page released pages are queued after */
+};
+
+#define META_MAGIC 0x4542444d /* "MDBE" */
+#define META_FORMAT 6
+#define NUM_META_PAGES 2
+
+/*
+ * The file starts with two meta pages, each holding a copy of the header. A
+ * commit writes the one holding the older copy, so a crash in the middle
+ * leaves the other intact; the checksum tells which are whole. Opening a
+ * database reads both and takes the newer valid one. The page size comes from
+ * the header, so if the first meta page is damaged the second one is looked
+ * for at every page size.
+ */
+typedef struct meta_t
+{
+	uint32_t magic;
+	uint32_t format;
+	database_file_t header;
+	uint64_t checksum; /* of the fields above */
+} meta_t;
+
+/*
+ * read the newest valid header of the file into @header and set the page size
+ * of @database from it (EINVAL if there is none)
+ */
+int meta_load(database_t *database, database_file_t *header);
+/* fill @meta in with @header */
+void meta_init(meta_t *meta, const database_file_t *header);
+/* write @header to the meta page with the older header, unless it is newer */
+void meta_store(database_t *database, const database_file_t *header);
+
+/*
+ * Make sure the file holds at least @size bytes, growing it ahead of time as
+ * the options say; the writer lock must be held.
+ */
+int file_reserve(database_t *database, size_t size);
+
+int page_list_push(page_list_t *list, size_t number);
+void page_list_clear(page_list_t *list);
+
+/* return the address of page @number as seen by @transaction */
+page_t *page_get(transaction_t *transaction, size_t number);
+
+/*
+ * Tell the kernel the @count pages @numbers will be read soon, so it starts
+ * reading them in without the caller waiting; consecutive pages go in one
+ * hint.
+ */
+void page_prefetch(transaction_t *transaction, const size_t *numbers, size_t count);
+
+/* return whether page @number is in memory (1 if the kernel will not tell) */
+int page_resident(transaction_t *transaction, size_t number);
+
+/*
+ * Take every page of the freelist that can be reused now into
+ * transaction->reclaimed, highest first. Allocations take the lowest of them
+ * before anything else; those left at the commit go back at the head of the
+ * freelist.
+ */
+int page_reclaim(transaction_t *transaction);
+
+/* return a new dirty page for @transaction (P_INVALID on failure) */
+size_t page_allocate(transaction_t *transaction);
+
+/*
+ * Return the first of @count consecutive new pages for @transaction (P_INVALID
+ * on failure): a run of reclaimed pages if there is one among the first few
+ * hundred, else pages from the end of the file. Only the first page is on the
+ * dirty list, as the others have no header.
+ */
+size_t page_allocate_run(transaction_t *transaction, size_t count);
+
+/*
+ * Take @count consecutive pages below @limit off transaction->reclaimed, the
+ * lowest ones first, and return the first (P_INVALID if there are none).
+ */
+size_t page_take_run(transaction_t *transaction, size_t count, size_t limit);
+
+/* return the number of pages @page starts: its run if it overflows, else 1 */
+size_t page_span(page_t *page);
+
+/* release page @number, which @transaction no longer references */
+int page_free(transaction_t *transaction, size_t number);
+
+/* release the @count pages of the run at @number */
+int page_free_run(transaction_t *transaction, size_t number, size_t count);
+
+/* queue the pages released by @transaction on the freelist */
+int page_retire(transaction_t *transaction);
+
+#endif /* PAGE_H */
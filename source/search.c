@@ -0,0 +1,108 @@
+#include "search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+typedef void (*heads_count_t)(const uint32_t *heads, size_t count, uint32_t head,
+		size_t *less, size_t *equal);
+
+/*
+ * Every kernel stops after the first group of heads holding one greater than
+ * @head: the heads are sorted, so none of the next ones can count.
+ */
+
+static void heads_count_scalar(const uint32_t *heads, size_t count, uint32_t head,
+		size_t *less, size_t *equal)
+{
+	size_t l = 0, e = 0;
+	for (size_t i = 0; i < count && (int32_t) heads[i] <= (int32_t) head; i++)
+	{
+		l += (int32_t) heads[i] < (int32_t) head;
+		e += heads[i] == head;
+	}
+	*less = l;
+	*equal = e;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("sse2")))
+static void heads_count_sse2(const uint32_t *heads, size_t count, uint32_t head,
+		size_t *less, size_t *equal)
+{
+	__m128i key = _mm_set1_epi32((int32_t) head);
+	size_t l = 0, e = 0, i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i group = _mm_loadu_si128((const __m128i *) (heads + i));
+		int lt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(group, key)));
+		int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(group, key)));
+		l += __builtin_popcount(lt);
+		e += __builtin_popcount(eq);
+		if ((lt | eq) != 0xf)
+		{
+			*less = l;
+			*equal = e;
+			return;
+		}
+	}
+	size_t tail_less, tail_equal;
+	heads_count_scalar(heads + i, count - i, head, &tail_less, &tail_equal);
+	*less = l + tail_less;
+	*equal = e + tail_equal;
+}
+
+__attribute__((target("avx2")))
+static void heads_count_avx2(const uint32_t *heads, size_t count, uint32_t head,
+		size_t *less, size_t *equal)
+{
+	__m256i key = _mm256_set1_epi32((int32_t) head);
+	size_t l = 0, e = 0, i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i group = _mm256_loadu_si256((const __m256i *) (heads + i));
+		int lt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key, group)));
+		int eq = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(group, key)));
+		l += __builtin_popcount(lt);
+		e += __builtin_popcount(eq);
+		if ((lt | eq) != 0xff)
+		{
+			*less = l;
+			*equal = e;
+			return;
+		}
+	}
+	size_t tail_less, tail_equal;
+	heads_count_sse2(heads + i, count - i, head, &tail_less, &tail_equal);
+	*less = l + tail_less;
+	*equal = e + tail_equal;
+}
+#endif
+
+static void heads_count_detect(const uint32_t *heads, size_t count, uint32_t head,
+		size_t *less, size_t *equal);
+
+/* written once by the first call; every thread picks the same kernel */
+static heads_count_t heads_kernel = heads_count_detect;
+
+static void heads_count_detect(const uint32_t *heads, size_t count, uint32_t head,
+		size_t *less, size_t *equal)
+{
+	heads_count_t kernel = heads_count_scalar;
+#ifdef SEARCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernel = heads_count_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		kernel = heads_count_sse2;
+#endif
+	__atomic_store_n(&heads_kernel, kernel, __ATOMIC_RELAXED);
+	kernel(heads, count, head, less, equal);
+}
+
+void heads_count(const uint32_t *heads, size_t count, uint32_t head, size_t *less,
+		size_t *equal)
+{
+	__atomic_load_n(&heads_kernel, __ATOMIC_RELAXED)(heads, count, head, less, equal);
+}
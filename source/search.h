@@ -0,0 +1,26 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Key heads: the first bytes of a key past the prefix its page shares, packed
+ * in an integer that orders like them (see btree.c). The heads of a page are
+ * kept sorted next to its slots, so searching a page mostly compares a key
+ * with many heads at once and the whole keys of a few entries.
+ *
+ * Heads are stored with their top bit flipped so that the signed compares of
+ * SSE2 and AVX2 order them as unsigned; HEAD_BIAS makes them so.
+ */
+#define HEAD_BIAS UINT32_C(0x80000000)
+
+/*
+ * Count the @count sorted @heads that are less than @head into *@less and the
+ * ones equal to it into *@equal. The kernel is picked on the first call from
+ * what the CPU supports: AVX2, SSE2 or plain C.
+ */
+void heads_count(const uint32_t *heads, size_t count, uint32_t head, size_t *less,
+		size_t *equal);
+
+#endif /* SEARCH_H */
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+int stats_open(database_t *database)
+{
+	if ((database->stats = aligned_alloc(CACHE_LINE_SIZE,
+			STATS_SHARDS * sizeof(stats_shard_t))) == NULL)
+		return -1;
+	memset(database->stats, 0, STATS_SHARDS * sizeof(stats_shard_t));
+	return 0;
+}
+
+void stats_close(database_t *database)
+{
+	free(database->stats);
+}
+
+database_counters_t *stats_counters(database_t *database)
+{
+	static size_t next;
+	static __thread size_t shard = SIZE_MAX;
+	if (shard == SIZE_MAX)
+		shard = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+	return &database->stats[shard].counters;
+}
+
+void stats_commit_latency(database_t *database, uint64_t ns)
+{
+	size_t bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+	if (bucket >= STATS_LATENCY_BUCKETS)
+		bucket = STATS_LATENCY_BUCKETS - 1;
+	STATS_ADD(database, commit_latency[bucket], 1);
+}
+
+void stats_sum(database_t *database, database_counters_t *counters)
+{
+	/* the counters are all uint64_t, so they can be added up as an array */
+	uint64_t *sum = (uint64_t *) counters;
+	size_t n = sizeof(database_counters_t) / sizeof(uint64_t);
+	memset(counters, 0, sizeof(database_counters_t));
+	for (size_t s = 0; s < STATS_SHARDS; s++)
+	{
+		uint64_t *shard = (uint64_t *) &database->stats[s].counters;
+		for (size_t i = 0; i < n; i++)
+			sum[i] += __atomic_load_n(&shard[i], __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "database.h"
+
+/*
+ * Counters are kept in a few shards of their own cache line each, and every
+ * thread sticks to one of them, so threads counting at once rarely share a
+ * line. database_stats adds the shards up.
+ */
+#define STATS_SHARDS 16
+
+struct stats_shard_t
+{
+	database_counters_t counters;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+int stats_open(database_t *database);
+void stats_close(database_t *database);
+
+/* the counters of the shard of the calling thread */
+database_counters_t *stats_counters(database_t *database);
+
+#define STATS_ADD(database, counter, n) \
+	__atomic_fetch_add(&stats_counters(database)->counter, (n), __ATOMIC_RELAXED)
+
+/* count a commit that took @ns nanoseconds */
+void stats_commit_latency(database_t *database, uint64_t ns);
+
+/* add the shards of @database up into @counters */
+void stats_sum(database_t *database, database_counters_t *counters);
+
+/* monotonic time in nanoseconds */
+uint64_t stats_now(void);
+
+#endif /* STATS_H */
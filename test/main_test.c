@@ -1,6 +1,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "test.h"
@@ -37,3 +42,1604 @@ TEST(database_new_unreadable) {
   database_t *database = database_new("/tmp/example");
   assert(database == NULL);
 }
+
+// when `/tmp/example` isn't a database then it returns NULL and leaves nothing
+// locked, so opening it again fails the same way instead of waiting
+TEST(database_new_garbage) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  int fd = open("/tmp/example", O_RDWR | O_CREAT | O_EXCL, 0666);
+  char garbage[16384];
+  memset(garbage, 0x5a, sizeof(garbage));
+  assert(write(fd, garbage, sizeof(garbage)) == (ssize_t) sizeof(garbage));
+  close(fd);
+
+  for (int i = 0; i < 2; i++) {
+    errno = 0;
+    assert(database_new("/tmp/example") == NULL);
+    assert(errno == EINVAL);
+  }
+  assert(unlink("/tmp/example") == 0);
+  database_t *database = database_new("/tmp/example");
+  assert(database != NULL);
+  database_close(database);
+}
+
+static void put_record(transaction_t *transaction, size_t i, const char *value) {
+  char key[32];
+  int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+  assert(db_put(transaction, key, key_size, value, strlen(value)) == 0);
+}
+
+static int has_record(transaction_t *transaction, size_t i, const char *value) {
+  char key[32];
+  int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+  const void *data;
+  size_t data_size;
+  if (db_get(transaction, key, key_size, &data, &data_size) == -1)
+    return 0;
+  return data_size == strlen(value) && memcmp(data, value, data_size) == 0;
+}
+
+static off_t file_size(const char *filename) {
+  struct stat st;
+  assert(stat(filename, &st) == 0);
+  return st.st_size;
+}
+
+// when more records are put than fit in a page then they are all found again
+// in a later transaction
+TEST(btree_many_records) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  assert(database != NULL);
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, (i * 7919) % 20000, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 20000; i++)
+    assert(has_record(transaction, i, "value"));
+  assert(!has_record(transaction, 20000, "value"));
+  commit_transaction(database, transaction);
+
+  assert(file_size("/tmp/example") > (off_t) (16 * PAGE_SIZE_MIN));
+  database_close(database);
+}
+
+// when a read transaction is running then it keeps seeing its version while
+// later transactions commit over it
+TEST(btree_snapshot_isolation) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "old");
+  commit_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+
+  for (size_t i = 0; i < 5000; i += 10) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, i, "new");
+    commit_transaction(database, transaction);
+  }
+
+  for (size_t i = 0; i < 5000; i++)
+    assert(has_record(reader, i, "old"));
+  commit_transaction(database, reader);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 5000; i++)
+    assert(has_record(transaction, i, i % 10 == 0 ? "new" : "old"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when records are deleted then they are gone and the rest are still there
+TEST(btree_delete) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 10000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 10000; i++) {
+    if (i % 3 != 0) {
+      char key[32];
+      int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+      assert(db_del(transaction, key, key_size) == 0);
+    }
+  }
+  assert(db_del(transaction, "missing", 7) == -1 && errno == ENOENT);
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 10000; i++)
+    assert(has_record(transaction, i, "value") == (i % 3 == 0));
+  for (size_t i = 0; i < 10000; i += 3) {
+    char key[32];
+    int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+    assert(db_del(transaction, key, key_size) == 0);
+  }
+  for (size_t i = 0; i < 10000; i++)
+    assert(!has_record(transaction, i, "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// a key of btree_key_heads: a long shared prefix, then up to 6 bytes of @i
+// that are often zero, so many keys are prefixes of others
+static size_t head_key(char *key, size_t i) {
+  size_t size = snprintf(key, 32, "a-long-shared-prefix/");
+  for (size_t j = 0; j < i % 7; j++)
+    key[size++] = (char) ((i >> (j * 2)) & 3);
+  return size;
+}
+
+// when keys share long prefixes, end in zero bytes or are prefixes of other
+// keys then they are all found and kept in order, and no other key is found
+TEST(btree_key_heads) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  size_t count = 0;
+  for (size_t i = 0; i < 14000; i += 2) {
+    char key[32];
+    size_t key_size = head_key(key, (i * 7919) % 14000);
+    if (db_get(transaction, key, key_size, &(const void *){ 0 }, &(size_t){ 0 }) == -1)
+      count++;
+    assert(db_put(transaction, key, key_size, key, key_size) == 0);
+  }
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 14000; i++) {
+    char key[32];
+    size_t key_size = head_key(key, i);
+    const void *value;
+    size_t value_size;
+    if (db_get(transaction, key, key_size, &value, &value_size) == 0)
+      assert(value_size == key_size && memcmp(value, key, key_size) == 0);
+  }
+  const void *value;
+  size_t value_size;
+  assert(db_get(transaction, "a-long-shared-prefix", 20, &value, &value_size) == -1);
+  assert(db_get(transaction, "a-long-shared-prefix/\4", 23, &value, &value_size) == -1);
+  assert(db_get(transaction, "b", 1, &value, &value_size) == -1);
+  assert(db_get(transaction, "", 0, &value, &value_size) == -1);
+
+  db_cursor_t *cursor = db_cursor_open(transaction);
+  char last[32];
+  size_t last_size = 0, found = 0;
+  for (int r = db_cursor_first(cursor); r == 0; r = db_cursor_next(cursor), found++) {
+    const void *key;
+    size_t key_size;
+    assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+    assert(db_get(transaction, key, key_size, &value, &value_size) == 0);
+    if (found > 0) {
+      size_t size = last_size < key_size ? last_size : key_size;
+      int r = memcmp(last, key, size);
+      assert(r < 0 || (r == 0 && last_size < key_size));
+    }
+    // the key may be kept by the cursor only until it moves
+    memcpy(last, key, key_size);
+    last_size = key_size;
+  }
+  assert(found == count);
+  db_cursor_close(cursor);
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// insert @count keys printed with @format in random order and return the pages
+// the database then uses
+static size_t insert_formatted(database_t *database, const char *format, size_t count) {
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < count; i++) {
+    char key[64];
+    int key_size = snprintf(key, sizeof(key), format, (i * 7919) % count);
+    assert(db_put(transaction, key, key_size, &i, sizeof(i)) == 0);
+  }
+  commit_transaction(database, transaction);
+
+  database_stats_t stats;
+  assert(database_stats(database, &stats) == 0);
+  return stats.num_pages - stats.free_pages;
+}
+
+// when keys share a long prefix then their leaves store it once, so they take
+// fewer pages than keys as long that barely share one, and they are still
+// found, in order both ways, as leaves split, merge and lose the prefix to
+// other keys
+TEST(btree_prefix_compression) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  const size_t count = 20000;
+  size_t unshared = insert_formatted(database, "%08zu/some/long/hierarchical/path", count);
+  database_close(database);
+
+  assert(unlink("/tmp/example") == 0);
+  database = database_new("/tmp/example");
+  size_t shared = insert_formatted(database, "some/long/hierarchical/path/%08zu", count);
+  assert(shared * 4 < unshared * 3);
+
+  // keys around the shared prefix and every other key deleted
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  assert(db_put(transaction, "some/long", 9, "short", 5) == 0);
+  assert(db_put(transaction, "some/other/path", 15, "other", 5) == 0);
+  for (size_t i = 0; i < count; i += 2) {
+    char key[64];
+    int key_size = snprintf(key, sizeof(key), "some/long/hierarchical/path/%08zu", i);
+    assert(db_del(transaction, key, key_size) == 0);
+  }
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < count; i++) {
+    char key[64];
+    int key_size = snprintf(key, sizeof(key), "some/long/hierarchical/path/%08zu", i);
+    const void *value;
+    size_t value_size;
+    assert(db_get(transaction, key, key_size, &value, &value_size) == (i % 2 ? 0 : -1));
+  }
+
+  db_cursor_t *cursor = db_cursor_open(transaction);
+  const void *key;
+  size_t key_size, found = 0;
+  assert(db_cursor_first(cursor) == 0);
+  assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+  assert(key_size == 9 && memcmp(key, "some/long", 9) == 0);
+  for (int r = db_cursor_next(cursor); r == 0; r = db_cursor_next(cursor), found++) {
+    assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+    if (found == count / 2)
+      break;
+    char expected[64];
+    int expected_size = snprintf(expected, sizeof(expected), "some/long/hierarchical/path/%08zu", found * 2 + 1);
+    assert(key_size == (size_t) expected_size && memcmp(key, expected, key_size) == 0);
+  }
+  assert(found == count / 2 && key_size == 15 && memcmp(key, "some/other/path", 15) == 0);
+
+  found = 0;
+  for (int r = db_cursor_last(cursor); r == 0; r = db_cursor_prev(cursor), found++) {
+    assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+    if (found > 0 && found <= count / 2) {
+      char expected[64];
+      int expected_size = snprintf(expected, sizeof(expected), "some/long/hierarchical/path/%08zu",
+          count - found * 2 + 1);
+      assert(key_size == (size_t) expected_size && memcmp(key, expected, key_size) == 0);
+    }
+  }
+  assert(found == count / 2 + 2);
+  db_cursor_close(cursor);
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// fill @value with @size bytes that tell @seed apart
+static void large_value(char *value, size_t size, size_t seed) {
+  for (size_t i = 0; i < size; i++)
+    value[i] = (char) (seed + i / 7);
+}
+
+static int has_large(transaction_t *transaction, const char *key, size_t size, size_t seed) {
+  static char expected[400 << 10];
+  const void *value;
+  size_t value_size;
+  if (db_get(transaction, key, strlen(key), &value, &value_size) == -1)
+    return 0;
+  large_value(expected, size, seed);
+  return value_size == size && memcmp(value, expected, size) == 0;
+}
+
+// when values are larger than a page then they are read in place from the
+// mapping, changing the other keys of their leaf copies none of their pages,
+// and replacing or deleting them releases their pages
+TEST(btree_overflow_values) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  static char value[400 << 10];
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 100; i++)
+    put_record(transaction, i, "value");
+  large_value(value, 100 << 10, 1);
+  assert(db_put(transaction, "key00000050+", 12, value, 100 << 10) == 0);
+  large_value(value, 300 << 10, 2);
+  assert(db_put(transaction, "key00000060+", 12, value, 300 << 10) == 0);
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  const void *found;
+  size_t found_size;
+  assert(db_get(transaction, "key00000060+", 12, &found, &found_size) == 0);
+  assert((const char *) found > database->map
+      && (const char *) found + found_size <= database->map + database->map_size);
+  assert(has_large(transaction, "key00000050+", 100 << 10, 1));
+  assert(has_large(transaction, "key00000060+", 300 << 10, 2));
+  db_cursor_t *cursor = db_cursor_open(transaction);
+  assert(db_cursor_seek(cursor, "key00000060", 11) == 0 && db_cursor_next(cursor) == 0);
+  const void *key;
+  size_t key_size;
+  assert(db_cursor_get(cursor, &key, &key_size, &found, &found_size) == 0);
+  assert(key_size == 12 && memcmp(key, "key00000060+", 12) == 0 && found_size == 300 << 10);
+  db_cursor_close(cursor);
+  commit_transaction(database, transaction);
+
+  database_stats_t before, after;
+  assert(database_stats(database, &before) == 0);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 59, "changed");
+  put_record(transaction, 61, "changed");
+  commit_transaction(database, transaction);
+  assert(database_stats(database, &after) == 0);
+  assert(after.counters.pages_freed - before.counters.pages_freed < 10);
+
+  // a run written by the transaction itself is reused by it
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  large_value(value, 400 << 10, 3);
+  assert(db_put(transaction, "key00000050+", 12, value, 400 << 10) == 0);
+  assert(db_put(transaction, "key00000050+", 12, "small", 5) == 0);
+  assert(db_put(transaction, "key00000050+", 12, value, 400 << 10) == 0);
+  assert(db_del(transaction, "key00000060+", 12) == 0);
+  commit_transaction(database, transaction);
+  assert(database_stats(database, &before) == 0);
+  assert(before.counters.pages_freed - after.counters.pages_freed > 100 + 75);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_large(transaction, "key00000050+", 400 << 10, 3));
+  assert(!has_large(transaction, "key00000060+", 300 << 10, 2));
+  assert(has_record(transaction, 59, "changed") && has_record(transaction, 60, "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when the tree has overflow runs then a compaction moves them down and a
+// backup renumbers them along with the leaves
+TEST(database_compact_overflow) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  assert(unlink("/tmp/example-backup") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  static char value[20 << 10];
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 40; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "large%02zu", i);
+    large_value(value, sizeof(value), i);
+    assert(db_put(transaction, key, strlen(key), value, sizeof(value)) == 0);
+  }
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 30; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "large%02zu", i);
+    assert(db_del(transaction, key, strlen(key)) == 0);
+  }
+  commit_transaction(database, transaction);
+
+  off_t size = file_size("/tmp/example");
+  assert(database_compact(database) == 0);
+  assert(file_size("/tmp/example") * 2 < size);
+
+  int fd = open("/tmp/example-backup", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  assert(fd != -1);
+  assert(database_backup(database, fd) == 0);
+  assert(close(fd) == 0);
+  database_close(database);
+
+  const char *files[] = { "/tmp/example", "/tmp/example-backup" };
+  for (size_t f = 0; f < 2; f++) {
+    database = database_new((char *) files[f]);
+    transaction = start_transaction(database, TRANSACTION_MODE_READ);
+    for (size_t i = 0; i < 40; i++) {
+      char key[32];
+      snprintf(key, sizeof(key), "large%02zu", i);
+      assert(has_large(transaction, key, sizeof(value), i) == (i >= 30));
+    }
+    commit_transaction(database, transaction);
+    database_close(database);
+  }
+}
+
+// when a transaction is cancelled then none of its changes are visible
+TEST(btree_cancel) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 1, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 1, "changed");
+  put_record(transaction, 2, "value");
+  cancel_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_record(transaction, 1, "value"));
+  assert(!has_record(transaction, 2, "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a write transaction commits then its tree replaces the previous one
+TEST(btree_write_replaces) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 1000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_WRITE);
+  put_record(transaction, 5000, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(!has_record(transaction, 1, "value"));
+  assert(has_record(transaction, 5000, "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when small updates are committed one by one then only the touched pages are
+// copied and the released pages are reused, so the file stops growing
+TEST(btree_commit_copies_path) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  off_t size = file_size("/tmp/example");
+
+  for (size_t i = 0; i < 2000; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, (i * 7919) % 20000, "other");
+    commit_transaction(database, transaction);
+  }
+
+  assert(file_size("/tmp/example") <= size + (off_t) (16 * PAGE_SIZE_MIN));
+  database_close(database);
+}
+
+static size_t load_records(database_t *database, size_t count, unsigned fill_percent) {
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_WRITE);
+  db_loader_t *loader = db_loader_open(transaction, fill_percent);
+  assert(loader != NULL);
+  for (size_t i = 0; i < count; i++) {
+    char key[32];
+    int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+    assert(db_loader_put(loader, key, key_size, "value", 5) == 0);
+  }
+  // keys out of order are refused
+  assert(db_loader_put(loader, "key", 3, "value", 5) == -1 && errno == EINVAL);
+  db_loader_close(loader);
+  commit_transaction(database, transaction);
+
+  database_stats_t stats;
+  assert(database_stats(database, &stats) == 0);
+  return stats.num_pages - stats.free_pages;
+}
+
+// when sorted records are bulk loaded then they are all found in order, in
+// fewer pages than inserting them in random order takes unless the leaves are
+// left half empty on purpose
+TEST(db_loader_sorted) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 50000; i++)
+    put_record(transaction, (i * 7919) % 50000, "value");
+  commit_transaction(database, transaction);
+  database_stats_t stats;
+  assert(database_stats(database, &stats) == 0);
+  size_t inserted = stats.num_pages - stats.free_pages;
+
+  size_t packed = load_records(database, 50000, 100);
+  assert(packed < inserted);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  db_cursor_t *cursor = db_cursor_open(transaction);
+  size_t i = 0;
+  for (int r = db_cursor_first(cursor); r == 0; r = db_cursor_next(cursor), i++) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "key%08zu", i);
+    const void *key;
+    size_t key_size;
+    assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+    assert(key_size == strlen(expected) && memcmp(key, expected, key_size) == 0);
+  }
+  assert(i == 50000);
+  db_cursor_close(cursor);
+  commit_transaction(database, transaction);
+  database_close(database);
+
+  assert(unlink("/tmp/example") == 0);
+  database = database_new("/tmp/example");
+  assert(load_records(database, 50000, 50) > packed * 3 / 2);
+  // the loaded tree takes inserts and deletes like any other
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  assert(db_loader_open(transaction, 100) == NULL && errno == EINVAL);
+  for (size_t i = 0; i < 50000; i += 7)
+    put_record(transaction, i * 3 + 1, "other");
+  for (size_t i = 0; i < 50000; i += 2) {
+    char key[32];
+    int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+    assert(db_del(transaction, key, key_size) == 0);
+  }
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(db_loader_open(transaction, 100) == NULL && errno == EACCES);
+  for (size_t i = 1; i < 50000; i += 2)
+    assert(has_record(transaction, i, i % 21 == 1 && i / 3 % 7 == 0 ? "other" : "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a batch of scattered puts and deletes is written then it commits once,
+// keeps the last operation on each key and copies each page it touches once
+TEST(db_batch_write) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+
+  db_batch_t *batch = db_batch_new(database);
+  assert(batch != NULL);
+  for (size_t i = 0; i < 5000; i++) {
+    char key[32];
+    int key_size = snprintf(key, sizeof(key), "key%08zu", (i * 7919) % 20000);
+    assert(db_batch_put(batch, key, key_size, "first", 5) == 0);
+    if (i % 2 == 0)
+      assert(db_batch_put(batch, key, key_size, "other", 5) == 0);
+    else
+      assert(db_batch_del(batch, key, key_size) == 0);
+  }
+  assert(db_batch_del(batch, "missing", 7) == 0);
+  database_stats_t before, after;
+  assert(database_stats(database, &before) == 0);
+  assert(db_batch_write(batch) == 0);
+  assert(database_stats(database, &after) == 0);
+
+  // then there is one commit and no page is allocated twice
+  assert(after.txnid == before.txnid + 1);
+  assert(after.counters.pages_allocated - before.counters.pages_allocated
+         <= before.num_pages - before.free_pages);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 20000; i++) {
+    size_t j = (i * 7919) % 20000;
+    if (i >= 5000)
+      assert(has_record(transaction, j, "value"));
+    else if (i % 2 == 0)
+      assert(has_record(transaction, j, "other"));
+    else
+      assert(!has_record(transaction, j, "value") && !has_record(transaction, j, "first"));
+  }
+  commit_transaction(database, transaction);
+
+  // when the batch fails then nothing of it is written and it is kept
+  char value[PAGE_SIZE_MIN];
+  memset(value, 'x', sizeof(value));
+  assert(db_batch_write(batch) == 0 && database_stats(database, &before) == 0);
+  assert(db_batch_put(batch, "key00000001", 11, "other", 5) == 0);
+  assert(db_batch_put(batch, value, sizeof(value), "big", 3) == 0);
+  assert(db_batch_write(batch) == -1 && errno == E2BIG);
+  assert(database_stats(database, &after) == 0 && after.txnid == before.txnid);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_record(transaction, 1, "value"));
+  commit_transaction(database, transaction);
+  db_batch_clear(batch);
+  assert(db_batch_write(batch) == 0);
+  db_batch_free(batch);
+  database_close(database);
+}
+
+// when many keys are looked up at once then each gets the value db_get finds,
+// in the order of the keys, whether they repeat, are missing or were just put
+TEST(db_multi_get) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i += 2)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+
+  static char names[1000][32];
+  db_item_t keys[1000], values[1000];
+  for (size_t i = 0; i < 1000; i++) {
+    keys[i].data = names[i];
+    // every tenth key is close to others
+    size_t j = (i * 7919) % 20000 / (i % 10 == 0 ? 100 : 1);
+    keys[i].size = snprintf(names[i], sizeof(names[i]), "key%08zu", j);
+  }
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 7919, "other");
+  assert(db_multi_get(transaction, keys, 1000, values) == 0);
+  for (size_t i = 0; i < 1000; i++) {
+    const void *value;
+    size_t value_size;
+    if (db_get(transaction, keys[i].data, keys[i].size, &value, &value_size) == -1) {
+      assert(values[i].data == NULL);
+      continue;
+    }
+    assert(values[i].data == value && values[i].size == value_size);
+  }
+  assert(values[1].size == 5 && memcmp(values[1].data, "other", 5) == 0);
+  assert(values[2].size == 5 && memcmp(values[2].data, "value", 5) == 0);
+  assert(values[3].data == NULL);
+  assert(db_multi_get(transaction, keys, 0, values) == 0);
+  commit_transaction(database, transaction);
+
+  // when the tree is empty then nothing is found
+  transaction = start_transaction(database, TRANSACTION_MODE_WRITE);
+  assert(db_multi_get(transaction, keys, 1000, values) == 0);
+  for (size_t i = 0; i < 1000; i++)
+    assert(values[i].data == NULL);
+  cancel_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a cursor walks the records then it returns them all in key order
+TEST(db_cursor_order) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, (i * 7919) % 5000, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  db_cursor_t *cursor = db_cursor_open(transaction);
+  assert(cursor != NULL);
+
+  size_t i = 0;
+  for (int r = db_cursor_first(cursor); r == 0; r = db_cursor_next(cursor), i++) {
+    char expected[32];
+    int expected_size = snprintf(expected, sizeof(expected), "key%08zu", i);
+    const void *key, *value;
+    size_t key_size, value_size;
+    assert(db_cursor_get(cursor, &key, &key_size, &value, &value_size) == 0);
+    assert(key_size == (size_t) expected_size);
+    assert(memcmp(key, expected, key_size) == 0);
+    assert(value_size == 5 && memcmp(value, "value", 5) == 0);
+  }
+  assert(errno == ENOENT);
+  assert(i == 5000);
+
+  assert(db_cursor_seek(cursor, "key00004000x", 12) == 0);
+  const void *key;
+  size_t key_size;
+  assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+  assert(key_size == 11 && memcmp(key, "key00004001", 11) == 0);
+  assert(db_cursor_seek(cursor, "z", 1) == -1 && errno == ENOENT);
+
+  db_cursor_close(cursor);
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a cursor walks the records backward then it returns them all in reverse
+// key order, and a long scan either way prefetches the leaves ahead of it
+TEST(db_cursor_reverse) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 50000; i++)
+    put_record(transaction, (i * 7919) % 50000, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  db_cursor_t *cursor = db_cursor_open(transaction);
+  database_stats_t before, after;
+  assert(database_stats(database, &before) == 0);
+  size_t i = 50000;
+  for (int r = db_cursor_last(cursor); r == 0; r = db_cursor_prev(cursor)) {
+    char expected[32];
+    int expected_size = snprintf(expected, sizeof(expected), "key%08zu", --i);
+    const void *key;
+    size_t key_size;
+    assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+    assert(key_size == (size_t) expected_size && memcmp(key, expected, key_size) == 0);
+  }
+  assert(errno == ENOENT && i == 0);
+  assert(database_stats(database, &after) == 0);
+  // then nearly every leaf was prefetched before the cursor reached it
+  size_t leaves = before.num_pages - before.free_pages;
+  assert(after.counters.pages_prefetched - before.counters.pages_prefetched > leaves / 2);
+
+  assert(database_stats(database, &before) == 0);
+  for (int r = db_cursor_first(cursor); r == 0; r = db_cursor_next(cursor))
+    i++;
+  assert(i == 50000);
+  assert(database_stats(database, &after) == 0);
+  assert(after.counters.pages_prefetched - before.counters.pages_prefetched > leaves / 2);
+
+  // when seeking backward then it stops on the key or the one before it
+  const void *key;
+  size_t key_size;
+  assert(db_cursor_seek_last(cursor, "key00004000x", 12) == 0);
+  assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+  assert(key_size == 11 && memcmp(key, "key00004000", 11) == 0);
+  assert(db_cursor_seek_last(cursor, "key00004000", 11) == 0);
+  assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+  assert(key_size == 11 && memcmp(key, "key00004000", 11) == 0);
+  assert(db_cursor_seek_last(cursor, "z", 1) == 0);
+  assert(db_cursor_get(cursor, &key, &key_size, NULL, NULL) == 0);
+  assert(key_size == 11 && memcmp(key, "key00049999", 11) == 0);
+  assert(db_cursor_seek_last(cursor, "a", 1) == -1 && errno == ENOENT);
+  assert(db_cursor_prev(cursor) == -1 && errno == ENOENT);
+
+  db_cursor_close(cursor);
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a read transaction modifies then it fails with EACCES, and values it
+// got stay in place while a writer commits
+TEST(db_read_transaction) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_WRITE);
+  assert(db_put(transaction, "a", 1, "first", 5) == 0);
+  const void *value;
+  size_t value_size;
+  assert(db_get(transaction, "a", 1, &value, &value_size) == 0);
+  commit_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(db_put(reader, "b", 1, "value", 5) == -1 && errno == EACCES);
+  assert(db_del(reader, "a", 1) == -1 && errno == EACCES);
+  assert(db_get(reader, "a", 1, &value, &value_size) == 0);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  assert(db_put(transaction, "a", 1, "second", 6) == 0);
+  commit_transaction(database, transaction);
+
+  assert(value_size == 5 && memcmp(value, "first", 5) == 0);
+  commit_transaction(database, reader);
+  database_close(database);
+}
+
+// when a reader pins an old version then the pages released since are kept,
+// and once it is done they are reused instead of growing the file
+TEST(freelist_reuse_after_reader) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "old");
+  commit_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 500; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, (i * 7919) % 5000, "new");
+    commit_transaction(database, transaction);
+  }
+  for (size_t i = 0; i < 5000; i++)
+    assert(has_record(reader, i, "old"));
+  commit_transaction(database, reader);
+
+  off_t size = file_size("/tmp/example");
+  for (size_t i = 0; i < 500; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, (i * 7919) % 5000, "old");
+    commit_transaction(database, transaction);
+  }
+  assert(file_size("/tmp/example") == size);
+  database_close(database);
+}
+
+// when readers pin several versions then the oldest one holds pages back, and
+// once it ends the pages of every version before the next are reused
+TEST(freelist_reclaims_behind_oldest_reader) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.grow_step = 0;
+  options.grow_percent = 0;
+  database_t *database = database_new_with("/tmp/example", &options);
+  database_stats_t stats;
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 2000; i++)
+    put_record(transaction, i, "old");
+  commit_transaction(database, transaction);
+  transaction_t *oldest = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(database_stats(database, &stats) == 0);
+  size_t txnid = stats.txnid;
+
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 2000; i++)
+    put_record(transaction, i, "new");
+  commit_transaction(database, transaction);
+  // a second reader in the same thread
+  transaction_t *newer = start_transaction(database, TRANSACTION_MODE_READ);
+
+  for (size_t i = 0; i < 200; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, (i * 7919) % 2000, "newest");
+    commit_transaction(database, transaction);
+  }
+  assert(database_stats(database, &stats) == 0);
+  assert(stats.readers == 2 && stats.pinned_versions == 2);
+  assert(stats.oldest_reader == txnid);
+  for (size_t i = 0; i < 2000; i++) {
+    assert(has_record(oldest, i, "old"));
+    assert(has_record(newer, i, "new"));
+  }
+
+  commit_transaction(database, oldest);
+  assert(database_stats(database, &stats) == 0);
+  assert(stats.readers == 1 && stats.oldest_reader == txnid + 1);
+  off_t size = file_size("/tmp/example");
+  for (size_t i = 0; i < 200; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, (i * 7919) % 2000, "newest");
+    commit_transaction(database, transaction);
+  }
+  assert(file_size("/tmp/example") == size);
+  commit_transaction(database, newer);
+
+  assert(database_stats(database, &stats) == 0);
+  assert(stats.readers == 0 && stats.oldest_reader == 0);
+  database_close(database);
+}
+
+// when a read-write transaction changes nothing then it copies no page
+TEST(btree_unchanged_copies_nothing) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.grow_step = 0;
+  options.grow_percent = 0;
+  database_t *database = database_new_with("/tmp/example", &options);
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+
+  // the reader keeps released pages from being reused
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  off_t size = file_size("/tmp/example");
+  for (size_t i = 0; i < 100; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    assert(db_del(transaction, "missing", 7) == -1 && errno == ENOENT);
+    put_record(transaction, i * 37, "value");
+    assert(has_record(transaction, i * 37, "value"));
+    commit_transaction(database, transaction);
+  }
+  assert(file_size("/tmp/example") == size);
+  commit_transaction(database, reader);
+  database_close(database);
+}
+
+// when a transaction ends then its handle is used again by the next one
+TEST(transaction_handles_reused) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  commit_transaction(database, transaction);
+  for (size_t i = 0; i < 10; i++) {
+    transaction_t *again = start_transaction(database, i % 2 ? TRANSACTION_MODE_READ : TRANSACTION_MODE_RW);
+    assert(again == transaction);
+    cancel_transaction(database, again);
+  }
+  database_close(database);
+}
+
+// when a transaction is started in caller storage then it runs there
+TEST(transaction_caller_storage) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t storage;
+  transaction_t *transaction = start_transaction_with(database, TRANSACTION_MODE_RW, &storage);
+  assert(transaction == &storage);
+  put_record(transaction, 0, "value");
+  commit_transaction(database, transaction);
+
+  transaction = start_transaction_with(database, TRANSACTION_MODE_READ, &storage);
+  assert(transaction == &storage);
+  assert(has_record(transaction, 0, "value"));
+  commit_transaction(database, transaction);
+
+  // caller storage is never handed out by start_transaction
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(transaction != &storage);
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when transactions run then the stats count them, and a reader pinning a
+// version shows up with the pages it keeps from being reused
+TEST(database_stats_counts) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  database_stats_t before, after;
+  assert(database_stats(database, &before) == 0);
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  cancel_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 50; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, i * 97, "other");
+    commit_transaction(database, transaction);
+  }
+  assert(database_stats(database, &after) == 0);
+
+  assert(after.counters.rw_started - before.counters.rw_started == 51);
+  assert(after.counters.rw_committed - before.counters.rw_committed == 51);
+  assert(after.counters.read_started - before.counters.read_started == 2);
+  assert(after.counters.read_cancelled - before.counters.read_cancelled == 1);
+  assert(after.counters.pages_allocated > before.counters.pages_allocated);
+  assert(after.counters.pages_freed > before.counters.pages_freed);
+  uint64_t commits = 0;
+  for (size_t i = 0; i < STATS_LATENCY_BUCKETS; i++)
+    commits += after.counters.commit_latency[i] - before.counters.commit_latency[i];
+  assert(commits == 51);
+
+  assert(after.txnid == before.txnid + 51);
+  assert(after.readers == 1 && after.pinned_versions == 1);
+  assert(after.free_pages > 0);
+  assert(after.num_pages * after.page_size <= after.file_size);
+  assert(after.file_size == (size_t) file_size("/tmp/example"));
+
+  commit_transaction(database, reader);
+  assert(database_stats(database, &after) == 0);
+  assert(after.readers == 0 && after.pinned_versions == 0);
+  database_close(database);
+}
+
+// when the file grows while a reader holds values then they stay in place
+TEST(map_values_survive_growth) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.grow_step = 0;
+  options.grow_percent = 0;
+  database_t *database = database_new_with("/tmp/example", &options);
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 0, "first");
+  commit_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  const void *value;
+  size_t value_size;
+  assert(db_get(reader, "key00000000", 11, &value, &value_size) == 0);
+  off_t size = file_size("/tmp/example");
+
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 100000; i++)
+    put_record(transaction, i, "second");
+  commit_transaction(database, transaction);
+
+  assert(file_size("/tmp/example") > 100 * size);
+  assert(value_size == 5 && memcmp(value, "first", 5) == 0);
+  commit_transaction(database, reader);
+  database_close(database);
+}
+
+// when a database is opened again then its records are still there
+TEST(database_reopen) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  database_close(database);
+
+  database = database_new("/tmp/example");
+  assert(database != NULL);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    assert(has_record(transaction, i, "value"));
+  put_record(transaction, 5000, "value");
+  commit_transaction(database, transaction);
+  database_close(database);
+
+  database = database_new("/tmp/example");
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_record(transaction, 5000, "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+static void corrupt_page(const char *filename, size_t number, size_t page_size) {
+  int fd = open(filename, O_RDWR);
+  assert(fd != -1);
+  char garbage[64];
+  memset(garbage, 0x5a, sizeof(garbage));
+  assert(pwrite(fd, garbage, sizeof(garbage), number * page_size) == sizeof(garbage));
+  close(fd);
+}
+
+// when one meta page is damaged then the database opens from the other one,
+// and when both are then it doesn't open
+TEST(database_reopen_damaged_meta) {
+  int found_first = 0, found_second = 0;
+  for (size_t meta = 0; meta < 2; meta++) {
+    assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+    database_t *database = database_new("/tmp/example");
+    transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, 0, "first");
+    commit_transaction(database, transaction);
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, 0, "second");
+    commit_transaction(database, transaction);
+    database_close(database);
+
+    corrupt_page("/tmp/example", meta, PAGE_SIZE_MIN);
+    database = database_new("/tmp/example");
+    assert(database != NULL);
+    transaction = start_transaction(database, TRANSACTION_MODE_READ);
+    found_first |= has_record(transaction, 0, "first");
+    found_second |= has_record(transaction, 0, "second");
+    commit_transaction(database, transaction);
+    database_close(database);
+  }
+  assert(found_first && found_second);
+
+  corrupt_page("/tmp/example", 0, PAGE_SIZE_MIN);
+  corrupt_page("/tmp/example", 1, PAGE_SIZE_MIN);
+  errno = 0;
+  assert(database_new("/tmp/example") == NULL && errno == EINVAL);
+}
+
+// when a database is backed up while a writer runs then the backup holds the
+// last commit in fewer pages, and opens as a database of its own
+TEST(database_backup_compacted) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  assert(unlink("/tmp/example-backup") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "old");
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i += 2) {
+    char key[32];
+    int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+    assert(db_del(transaction, key, key_size) == 0);
+  }
+  commit_transaction(database, transaction);
+
+  // the writer is neither waited for nor seen
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "new");
+  int fd = open("/tmp/example-backup", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  assert(fd != -1);
+  assert(database_backup(database, fd) == 0);
+  assert(close(fd) == 0);
+  commit_transaction(database, transaction);
+  assert(file_size("/tmp/example-backup") < file_size("/tmp/example"));
+  database_close(database);
+
+  database = database_new("/tmp/example-backup");
+  assert(database != NULL);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 5000; i++)
+    assert(has_record(transaction, i, "old") == (i % 2 == 1));
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 0, "new");
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_record(transaction, 0, "new") && has_record(transaction, 1, "old"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+static size_t export_to(database_t *database, const char *filename, size_t since) {
+  size_t txnid;
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  assert(fd != -1);
+  assert(database_export(database, fd, since, &txnid) == 0);
+  assert(close(fd) == 0);
+  return txnid;
+}
+
+static int restore_from(database_t *database, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  assert(fd != -1);
+  int r = database_restore(database, fd);
+  assert(close(fd) == 0);
+  return r;
+}
+
+// when increments exported after a full export are restored in order then the
+// copy ends up with the last commit, and each increment only holds the pages
+// changed since the one before
+TEST(database_export_incremental) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  assert(unlink("/tmp/example-copy") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "old");
+  commit_transaction(database, transaction);
+  size_t txnid = export_to(database, "/tmp/example-full", 0);
+
+  for (size_t round = 0; round < 2; round++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    for (size_t i = round * 50; i < round * 50 + 50; i++)
+      put_record(transaction, i, "new");
+    commit_transaction(database, transaction);
+    txnid = export_to(database, round ? "/tmp/example-inc2" : "/tmp/example-inc1", txnid);
+  }
+  assert(file_size("/tmp/example-inc1") * 10 < file_size("/tmp/example-full"));
+  database_close(database);
+
+  database = database_new("/tmp/example-copy");
+  // an increment does not apply before the ones it follows
+  assert(restore_from(database, "/tmp/example-inc1") == -1 && errno == EINVAL);
+  assert(restore_from(database, "/tmp/example-full") == 0);
+  assert(restore_from(database, "/tmp/example-inc2") == -1 && errno == EINVAL);
+  assert(restore_from(database, "/tmp/example-inc1") == 0);
+  assert(restore_from(database, "/tmp/example-inc2") == 0);
+  database_close(database);
+
+  database = database_new("/tmp/example-copy");
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 20000; i++)
+    assert(has_record(transaction, i, i < 100 ? "new" : "old"));
+  commit_transaction(database, transaction);
+  database_stats_t stats;
+  assert(database_stats(database, &stats) == 0 && stats.txnid == txnid);
+  // and takes commits of its own
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "copy");
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a database that never committed is exported whole then the export
+// restores into another new database, but not once that one has committed
+TEST(database_export_new) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  assert(unlink("/tmp/example-copy") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+  export_to(database, "/tmp/example-full", 0);
+  database_close(database);
+
+  database = database_new("/tmp/example-copy");
+  assert(restore_from(database, "/tmp/example-full") == 0);
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 1, "value");
+  commit_transaction(database, transaction);
+  database_close(database);
+
+  database = database_new("/tmp/example-copy");
+  assert(restore_from(database, "/tmp/example-full") == -1 && errno == EINVAL);
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_record(transaction, 1, "value"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when a database is created with large pages then it keeps them when opened
+// again with other options, even when its first meta page is damaged
+TEST(page_size_recorded) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.page_size = PAGE_SIZE_MAX;
+  database_t *database = database_new_with("/tmp/example", &options);
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 0, "other");
+  commit_transaction(database, transaction);
+  database_close(database);
+  assert(file_size("/tmp/example") % PAGE_SIZE_MAX == 0);
+
+  for (size_t meta = 0; meta < 2; meta++) {
+    database = database_new("/tmp/example");
+    assert(database != NULL);
+    transaction = start_transaction(database, TRANSACTION_MODE_READ);
+    for (size_t i = 1; i < 20000; i++)
+      assert(has_record(transaction, i, "value"));
+    commit_transaction(database, transaction);
+    database_close(database);
+    corrupt_page("/tmp/example", 0, PAGE_SIZE_MAX);
+  }
+}
+
+// when the page size is out of bounds or not a power of two then it fails
+TEST(page_size_invalid) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  size_t sizes[] = { 0, PAGE_SIZE_MIN / 2, PAGE_SIZE_MIN * 3, PAGE_SIZE_MAX * 2 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    database_options_t options = DATABASE_OPTIONS_DEFAULT;
+    options.page_size = sizes[i];
+    errno = 0;
+    assert(database_new_with("/tmp/example", &options) == NULL && errno == EINVAL);
+  }
+}
+
+// when the file runs out of pages then it grows by a chunk at a time
+TEST(file_grows_in_chunks) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  size_t page_size = PAGE_SIZE_MIN;
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.grow_step = 64 * page_size;
+  options.grow_percent = 0;
+  database_t *database = database_new_with("/tmp/example", &options);
+  assert(file_size("/tmp/example") == (off_t) (66 * page_size));
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  assert((file_size("/tmp/example") - (off_t) (2 * page_size)) % (off_t) (64 * page_size) == 0);
+  database_close(database);
+}
+
+// when the file is large then it grows by a share of its size
+TEST(file_grows_geometrically) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  size_t page_size = PAGE_SIZE_MIN;
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.grow_step = page_size;
+  options.grow_percent = 100;
+  database_t *database = database_new_with("/tmp/example", &options);
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  size_t pages = file_size("/tmp/example") / page_size;
+  assert(pages > 64 && (pages & (pages - 1)) == 0);
+  database_close(database);
+}
+
+// when most records are deleted then compacting moves the rest to the start
+// of the file and cuts it, while a reader of an older version still sees it
+TEST(database_compact_shrinks) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    put_record(transaction, i, "value");
+  commit_transaction(database, transaction);
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++) {
+    if (i % 10 != 0) {
+      char key[32];
+      int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+      assert(db_del(transaction, key, key_size) == 0);
+    }
+  }
+  commit_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(database_compact(database) == 0);
+  for (size_t i = 0; i < 20000; i++)
+    assert(has_record(reader, i, "value") == (i % 10 == 0));
+  commit_transaction(database, reader);
+
+  off_t size = file_size("/tmp/example");
+  assert(database_compact(database) == 0);
+  assert(file_size("/tmp/example") * 4 < size);
+  database_stats_t stats;
+  assert(database_stats(database, &stats) == 0);
+  assert(stats.file_size == stats.num_pages * stats.page_size);
+  assert(stats.free_pages * 2 < stats.num_pages);
+  database_close(database);
+
+  database = database_new("/tmp/example");
+  transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 20000; i++)
+    assert(has_record(transaction, i, "value") == (i % 10 == 0));
+  for (size_t i = 0; i < 2000; i++)
+    put_record(transaction, i, "again");
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when commits are made in any sync mode then they are all found again
+TEST(sync_modes) {
+  SYNC_MODE modes[] = { SYNC_MODE_NONE, SYNC_MODE_ASYNC, SYNC_MODE_COMMIT, SYNC_MODE_GROUP };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+    database_options_t options = DATABASE_OPTIONS_DEFAULT;
+    options.sync = modes[m];
+    database_t *database = database_new_with("/tmp/example", &options);
+
+    for (size_t i = 0; i < 20; i++) {
+      transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+      put_record(transaction, i, "value");
+      commit_transaction(database, transaction);
+    }
+
+    transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_READ);
+    for (size_t i = 0; i < 20; i++)
+      assert(has_record(transaction, i, "value"));
+    commit_transaction(database, transaction);
+    database_close(database);
+  }
+}
+
+#define THREADS_NUM 4
+#define THREADS_ROUNDS 200
+
+static void *increment_counter(void *argument) {
+  database_t *database = argument;
+  for (size_t i = 0; i < THREADS_ROUNDS; i++) {
+    transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    const void *value;
+    size_t value_size;
+    size_t counter = 0;
+    if (db_get(transaction, "counter", 7, &value, &value_size) == 0)
+      memcpy(&counter, value, sizeof(counter));
+    counter++;
+    assert(db_put(transaction, "counter", 7, &counter, sizeof(counter)) == 0);
+    commit_transaction(database, transaction);
+  }
+  return NULL;
+}
+
+static void check_counter(database_t *database) {
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  const void *value;
+  size_t value_size;
+  size_t counter;
+  assert(db_get(transaction, "counter", 7, &value, &value_size) == 0);
+  memcpy(&counter, value, sizeof(counter));
+  assert(counter == THREADS_NUM * THREADS_ROUNDS);
+  commit_transaction(database, transaction);
+}
+
+// when several threads update the database at once then no update is lost
+TEST(threads_writers_serialized) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  pthread_t threads[THREADS_NUM];
+  for (size_t i = 0; i < THREADS_NUM; i++)
+    assert(pthread_create(&threads[i], NULL, increment_counter, database) == 0);
+  for (size_t i = 0; i < THREADS_NUM; i++)
+    assert(pthread_join(threads[i], NULL) == 0);
+
+  check_counter(database);
+  database_close(database);
+}
+
+// when several threads commit with group commit then they share flushes and
+// no update is lost
+TEST(threads_group_commit) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.sync = SYNC_MODE_GROUP;
+  options.sync_delay = 100;
+  database_t *database = database_new_with("/tmp/example", &options);
+
+  pthread_t threads[THREADS_NUM];
+  for (size_t i = 0; i < THREADS_NUM; i++)
+    assert(pthread_create(&threads[i], NULL, increment_counter, database) == 0);
+  for (size_t i = 0; i < THREADS_NUM; i++)
+    assert(pthread_join(threads[i], NULL) == 0);
+
+  check_counter(database);
+  database_close(database);
+}
+
+static int readers_done;
+
+static void *read_snapshots(void *argument) {
+  database_t *database = argument;
+  while (!__atomic_load_n(&readers_done, __ATOMIC_ACQUIRE)) {
+    transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_READ);
+    assert(transaction != NULL);
+    const void *first;
+    size_t first_size;
+    assert(db_get(transaction, "key00000000", 11, &first, &first_size) == 0);
+    for (size_t i = 1; i < 100; i++) {
+      char key[32];
+      int key_size = snprintf(key, sizeof(key), "key%08zu", i);
+      const void *value;
+      size_t value_size;
+      assert(db_get(transaction, key, key_size, &value, &value_size) == 0);
+      assert(value_size == first_size && memcmp(value, first, value_size) == 0);
+    }
+    commit_transaction(database, transaction);
+  }
+  return NULL;
+}
+
+// when readers run while a writer commits then each of them sees a whole
+// version
+TEST(threads_readers_consistent) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 100; i++)
+    put_record(transaction, i, "0");
+  commit_transaction(database, transaction);
+
+  pthread_t threads[THREADS_NUM];
+  for (size_t i = 0; i < THREADS_NUM; i++)
+    assert(pthread_create(&threads[i], NULL, read_snapshots, database) == 0);
+
+  for (size_t round = 1; round <= THREADS_ROUNDS; round++) {
+    char value[32];
+    snprintf(value, sizeof(value), "%zu", round);
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    for (size_t i = 0; i < 100; i++)
+      put_record(transaction, i, value);
+    commit_transaction(database, transaction);
+  }
+
+  __atomic_store_n(&readers_done, 1, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < THREADS_NUM; i++)
+    assert(pthread_join(threads[i], NULL) == 0);
+  database_close(database);
+}
+
+static pthread_barrier_t idle_read, idle_exit;
+
+static void *read_then_idle(void *argument) {
+  database_t *database = argument;
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(transaction != NULL);
+  commit_transaction(database, transaction);
+  pthread_barrier_wait(&idle_read);
+  pthread_barrier_wait(&idle_exit);
+  // the slot the thread kept may have been taken back meanwhile
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(transaction != NULL && has_record(transaction, 1, "value"));
+  commit_transaction(database, transaction);
+  return NULL;
+}
+
+// when more threads than reader slots have read and are idle then reads
+// still start, taking back the slots the idle threads keep, while as many
+// reads as there are slots can run at once
+TEST(threads_idle_readers) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_options_t options = DATABASE_OPTIONS_DEFAULT;
+  options.max_readers = 4;
+  database_t *database = database_new_with("/tmp/example", &options);
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 1, "value");
+  commit_transaction(database, transaction);
+
+  pthread_t threads[8];
+  assert(pthread_barrier_init(&idle_read, NULL, 2) == 0);
+  assert(pthread_barrier_init(&idle_exit, NULL, 9) == 0);
+  for (size_t i = 0; i < 8; i++) {
+    assert(pthread_create(&threads[i], NULL, read_then_idle, database) == 0);
+    pthread_barrier_wait(&idle_read);
+  }
+
+  transaction_t *readers[4];
+  for (size_t i = 0; i < 4; i++) {
+    readers[i] = start_transaction(database, TRANSACTION_MODE_READ);
+    assert(readers[i] != NULL && has_record(readers[i], 1, "value"));
+  }
+  assert(start_transaction(database, TRANSACTION_MODE_READ) == NULL && errno == EAGAIN);
+  for (size_t i = 0; i < 4; i++)
+    commit_transaction(database, readers[i]);
+
+  pthread_barrier_wait(&idle_exit);
+  for (size_t i = 0; i < 8; i++)
+    assert(pthread_join(threads[i], NULL) == 0);
+  pthread_barrier_destroy(&idle_read);
+  pthread_barrier_destroy(&idle_exit);
+  database_stats_t stats;
+  assert(database_stats(database, &stats) == 0 && stats.readers == 0);
+  database_close(database);
+}
+
+static void run_child(void (*child)(void)) {
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    child();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void update_records(void) {
+  database_t *database = database_new("/tmp/example");
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 1000; i++)
+    put_record(transaction, i, "child");
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+// when another process opens the database then it sees and updates the same
+// data, while the readers of this process keep their version
+TEST(process_shared_database) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 1000; i++)
+    put_record(transaction, i, "parent");
+  commit_transaction(database, transaction);
+
+  transaction_t *reader = start_transaction(database, TRANSACTION_MODE_READ);
+  run_child(update_records);
+  for (size_t i = 0; i < 1000; i++)
+    assert(has_record(reader, i, "parent"));
+  commit_transaction(database, reader);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  for (size_t i = 0; i < 1000; i++)
+    assert(has_record(transaction, i, "child"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
+
+static void die_in_transactions(void) {
+  database_t *database = database_new("/tmp/example");
+  start_transaction(database, TRANSACTION_MODE_READ);
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  put_record(transaction, 0, "lost");
+}
+
+// when a process dies in the middle of transactions then its writer lock and
+// reader slot are taken back
+TEST(process_dead_transactions) {
+  assert(unlink("/tmp/example") == 0 || errno == ENOENT);
+  database_t *database = database_new("/tmp/example");
+
+  transaction_t *transaction = start_transaction(database, TRANSACTION_MODE_RW);
+  for (size_t i = 0; i < 5000; i++)
+    put_record(transaction, i, "old");
+  commit_transaction(database, transaction);
+  run_child(die_in_transactions);
+
+  for (size_t i = 0; i < 500; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    assert(transaction != NULL);
+    put_record(transaction, (i * 7919) % 5000, "new");
+    commit_transaction(database, transaction);
+  }
+  off_t size = file_size("/tmp/example");
+  for (size_t i = 0; i < 500; i++) {
+    transaction = start_transaction(database, TRANSACTION_MODE_RW);
+    put_record(transaction, (i * 7919) % 5000, "old");
+    commit_transaction(database, transaction);
+  }
+  assert(file_size("/tmp/example") == size);
+
+  transaction = start_transaction(database, TRANSACTION_MODE_READ);
+  assert(has_record(transaction, 0, "old"));
+  commit_transaction(database, transaction);
+  database_close(database);
+}
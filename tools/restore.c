@@ -0,0 +1,66 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../source/database.h"
+
+/*
+ * Rebuild a database from the exports of database_export, applied in the
+ * order given: a full one first (unless the database has its predecessors
+ * applied already), then each increment taken after it.
+ *
+ *   restore_embeddeddb [-p page_size] database export...
+ *
+ * The page size must be the one of the exported database when the database is
+ * created by the restore.
+ */
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [-p page_size] database export...\n", program);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	database_options_t options = DATABASE_OPTIONS_DEFAULT;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				options.page_size = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+
+	database_t *database;
+	if ((database = database_new_with(argv[optind], &options)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for (int i = optind + 1; i < argc; i++)
+	{
+		int fd;
+		if ((fd = open(argv[i], O_RDONLY)) == -1 || database_restore(database, fd) == -1)
+		{
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			database_close(database);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+	}
+
+	database_close(database);
+	return EXIT_SUCCESS;
+}